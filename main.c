@@ -1,60 +1,278 @@
 /*Energy and magnetization for a 2D-Ising periodical
-  lattice using Wolff algorithm*/
+  lattice using Wolff, Swendsen-Wang or Metropolis algorithms
+  (compile with -fopenmp to run Swendsen-Wang on all cores
+   and parallel tempering with one replica per core)*/
 
 #include<stdio.h>
 #include<stdlib.h>
 #include<stdint.h>
+#include<string.h>
+#include<getopt.h>
 #include<math.h>
 #include<time.h>
+#include<stddef.h>
+#include<unistd.h>
+#include<sys/resource.h>
+#ifdef __linux__
+#include<linux/perf_event.h>
+#include<sys/syscall.h>
+#include<sys/ioctl.h>
+#endif
+#include "output.h"
+#include "prng.h"
+#ifdef _OPENMP
+#include<omp.h>
+#else
+#define omp_get_thread_num() 0
+#define omp_get_num_threads() 1
+#define omp_get_max_threads() 1
+#endif
 
 /*----VARIABLES----*/
 /*-----------------*/
 /*--Pre-definitions--*/
 #define NBLCKDISP 10     // max number of blocks to display
+#define MAXKAPPAS 256    // max number of replicas in parallel tempering
+#define STACK0 1024      // initial size of the cluster stack, it grows when needed
+#define NOBS 5           // averaged observables: e, e^2, |m|, m^2, m^4
+#define NDER 7           // reported observables: e, |m|, m^2, m^4, C, chi, U
+#define RNDBUF 256       // random numbers generated at a time by every thread
+#define MAXBENCH 32      // max number of lengths in a benchmark
+#define SPEC_SHIFT0 6    // kernels specialized for L=2^6..2^13 and every layout (none with -DNO_SPECIALIZE)
+#define SPEC_SHIFT1 13
+#define SPEC3_SHIFT0 4   // 3D Wolff and measure kernels specialized for L=2^4..2^9
+#define SPEC3_SHIFT1 9
+#define MAXDIM 4         // max dimension of the lattice
+#define BENCH_SEED 12345 // seed of every benchmark case
+#define CKPT_MAGIC   "ISINGCK"  // first 8 bytes of a checkpoint (with the final \0)
+#define CKPT_VERSION 8
+#define BOND_EPS 0x1p-32 // largest error of 1-exp(-2k) in bond tests narrower than 64 bits
+#define NPHASE 6         // timed phases of the metrics (PH_*)
+#define NPERF 5          // hardware counters of -P
+#define NHIST 31         // log_2 bins of the cluster size histogram (N up to 2^30)
+#define PH_THERM   0
+#define PH_PILOT   1
+#define PH_UPDATE  2
+#define PH_MEASURE 3
+#define PH_OUTPUT  4     // raw measures, blocks and metrics
+#define PH_CKPT    5
+#define PILOT 4096       // max steps of every pilot run of the scheduler (-A), autocorrelations up to PILOT/8
+
+#define SPIN(a, s) (((a)[(s)>>6] >> ((s)&63)) & 1)     // bit of site s in the bitmap a
+#define FLIP(a, s) ((a)[(s)>>6] ^= 1ULL << ((s)&63))    // flips bit of site s in the bitmap a
+/*neighbours: +1 or -1 along the coordinate held by the bits mk of s (with wrapping), as in Morton codes*/
+#define NEXT(s, mk) (((((s) | ~(mk)) + 1) & (mk)) | ((s) & ~(mk)))
+#define PREV(s, mk) (((((s) & (mk)) - 1) & (mk)) | ((s) & ~(mk)))
+#define COL0 0x0101010101010101ULL  // first and last column of an 8x8 tile
+#define COL7 0x8080808080808080ULL
+#define LAYOUT_ROWS   0     // site x+L*y, a word is 64 sites of a row (or whole rows if L<64)
+#define LAYOUT_TILES  1     // a word is an 8x8 tile (bit x%8+8*(y%8)), tiles row by row
+#define LAYOUT_MORTON 2     // same tiles in Z-order (Morton), L>=8 for both
 
 /*--Global variables--*/
 /*Lattice*/
 int16_t L;                 // length of the lattice (up to 2^14)
-uint32_t N;                 // number of particles (L*L)
+uint32_t N;                 // number of particles (L^dim)
 uint8_t  shift=1;           // log_2(L), at least 1
+uint32_t NW;                // number of 64-bit words of the lattice (N/64, at least 1)
+uint8_t  dim = 2;           // dimension of the hypercubic lattice, -d
+const double kappa_c[MAXDIM+1] = {0, 0, 0.4406868, 0.2216546, 0.1496947};  // critical kappa of every dimension
+uint8_t  layout = LAYOUT_ROWS,   // order of the sites in lat, -l
+         layout_given = 0;      // -l given (else a benchmark times every layout)
+uint32_t xmask, ymask,      // bits of a site index with its x and y (NEXT and PREV)
+         txmask, tymask;    // same for the word index of the tile layouts (tile x and y)
+const char *layout_names[3] = {"rows", "tiles", "morton"};
+typedef struct {
+    uint32_t N, NW, xmask, ymask, txmask, tymask;
+} geom_t;                   // sizes and masks of a layout and L (geometry())
+typedef struct {
+    void (*wolff)(), (*metropolis)(), (*measure)();
+} kernels_t;                // Wolff, metropolis and measure for a layout and L
+kernels_t kern;             // the ones for L, dim and the layout, specialized if there are (setup_lattice)
+uint8_t  force_generic = 0; // generic kernels even if there are specialized ones, -G
 
-int8_t *lat;                    // lattice (possible elements -1, +1, 0, -2)
-int16_t *rn, *ln, *un, *dn,     // relative positions of neighbours (+1, -1, +L, -L)
-        nn[4];                  // array for storing them
-uint32_t n;                     // neighbour (0,1,2,...,N)
+uint64_t *lat,                  // lattice, 1 bit per spin (1 for +1, 0 for -1), site s is bit s%64 of word s/64
+         *vis;                  // sites of the cluster being built (visited and to be flipped)
+uint32_t *stack,                // sites of the cluster waiting to be expanded (up to N)
+         nstack,                // number of sites in stack
+         sstack,                // size of stack
+         *cword,                // words of vis with sites of the cluster (up to NW)
+         ncword,                // number of words in cword
+         chain_NW;              // words of lat (to reuse it for the next chain of the same L)
+uint32_t *label;                // union-find parent of every site (for SW)
+uint8_t  *bond;                 // active bonds of every site, bit 0 right and bit 1 up (for SW)
+#pragma omp threadprivate(lat, vis, stack, nstack, sstack, cword, ncword, chain_NW)
 
 /*PRNG*/
-uint64_t rnd,           // PRNG
-         prob_bond;     // probability 1-exp(-2k)
-float    frnd;          // normalised rnd 0<frnd<=1 (for Wolff)
+uint64_t seed,          // seed of all the streams (-S, else the time)
+         rnd,           // last random number of this thread
+         rnd_buf[RNDBUF],   // next random numbers of this thread
+         bond_buf[RNDBUF],  // random numbers of the bond tests of this thread
+         prob_bond,     // probability 1-exp(-2k), as a threshold of bond_bits bits
+         prob_metro[3]; // Metropolis probabilities exp(-4k*c) for c=0,1,2
+uint32_t rnd_pos,        // next random number in rnd_buf (RNDBUF: empty)
+         bond_pos;       // next bond test in bond_buf, in bond_bits units (>= RNDBUF*64/bond_bits: empty)
+uint8_t  bond_bits,      // bits per bond test: 16, 32 or 64, 64/bond_bits tests per random number
+         bond_lg;        // log_2(64/bond_bits)
+prng_t   rng;           // generator of this thread (one stream per thread)
+#pragma omp threadprivate(seed, rnd, rnd_buf, bond_buf, prob_bond, prob_metro, rnd_pos, bond_pos, bond_bits, bond_lg, rng)
+uint8_t  prng_kind = PRNG_XOSHIRO,  // generator, -g
+         seed_given = 0,            // seed from -S
+         bond_force = 0;            // bits per bond test from -B (0: the fewest that BOND_EPS allows)
+const char *prng_names[2] = {"xoshiro", "philox"};
 
 /*Physical values*/
 float   kappa;          // constant J/kT
 double  e,              // observable energy density
         m;              // observable magnetization density
+int64_t E,              // sum of s_i*s_j over bonds (kept up to date by Wolff, else in the last measure)
+        M;              // sum of s_i (same)
+#pragma omp threadprivate(kappa, e, m, E, M)
 
 /*Simulation*/
-int8_t spin;            // value of the selected spin from the cluster
+uint8_t spin;           // bit of the selected spin from the cluster (1 for +1)
 
 uint8_t  nblock;        // number of blocks
 uint16_t nmeas,         // number of measures per block
          nupdte,        // number of updates between 2 measures
          ntherm;        // number of thermalization updates
+#pragma omp threadprivate(nblock, nmeas, nupdte, ntherm)    // every job of a batch has its own
 uint32_t Ncs,           // number of spins inside the cluster
          Nc;            // number of clusters (for SW)
+#pragma omp threadprivate(spin, Ncs)
 uint64_t ntotal;        // total number of updates
+uint16_t nt,            // thermalization updates done
+         nm;            // measures done in the current block
+uint8_t  nb;            // blocks done
+char     algorithm[12] = "wolff";   // wolff, sw or metropolis
+void   (*update)();     // MC update for the chosen algorithm
+int      nthreads = 0;  // threads for SW (0: OpenMP default)
+uint16_t ncheck = 0;    // measures between full recomputes of E and M when Wolff tracks them (0: never)
+uint32_t nmeasured;     // measures taken by this chain
+uint16_t nauto = 0;     // longest schedule the scheduler may choose, in updates per measure (0: nupdte of the arguments)
+uint8_t  mixable = 0,   // the scheduler may add a Metropolis sweep after every update (-M)
+         mix = 0,       // it did
+         tuned = 0;     // schedule chosen (or restored from the checkpoint)
+#pragma omp threadprivate(nmeasured)
+
+/*Parallel tempering*/
+int      nkappa = 0;            // number of replicas (0: no parallel tempering)
+float    kappas[MAXKAPPAS];     // increasing kappas, one per replica
+int      pt_kappa[MAXKAPPAS],   // kappa index held by every replica (thread)
+         pt_replica[MAXKAPPAS]; // replica holding every kappa index
+int64_t  pt_E[MAXKAPPAS];       // bond sum at every kappa index in the last swap
+uint64_t pt_tries[MAXKAPPAS],   // swap attempts between kappa index k and k+1
+         pt_accept[MAXKAPPAS];  // accepted swaps between kappa index k and k+1
+FILE    *pt_file[MAXKAPPAS];    // statistics file of every kappa index
+prng_t   pt_rng;                // swap decisions, stream nkappa of the seed (no replica's)
+
+/*Ensemble*/
+int      nchain = 0;            // independent chains at kappa, one per thread (0: no ensemble)
+
+/*Statistics*/
+typedef struct {
+    double   sum[NOBS],         // sums of the observables in the current block
+            *blk;               // means of the finished blocks, NOBS per block
+    uint32_t n;                 // measures in the current block
+    uint16_t nb;                // finished blocks (of all the chains when merged)
+} stats_t;
+stats_t  stats[MAXKAPPAS];      // statistics of every kappa index or chain (only 0 in single runs)
+FILE    *raw_file[MAXKAPPAS];   // every measure of every kappa index or chain, if raw
+FILE    *hist_file;             // joint (E, M) histogram of every block, if hist
+out_record *hbuf;               // E and M of the measures of the current block, if hist
+
+/*Batch*/
+typedef struct {
+    int16_t  L;
+    float    kappa;
+    uint8_t  nblock;
+    uint16_t nmeas, nupdte, ntherm;
+    uint64_t seed;
+    char    *out;               // output file of the job
+    int      id;                // line order in the job file
+} job_t;
+job_t   *jobs;                  // jobs of the job file, sorted by L
+int      njob = 0;              // number of jobs (0: no batch)
+char    *job_name = NULL;       // job file
+
+/*Benchmark*/
+int      nbench = 0;            // number of lengths (0: no benchmark)
+int16_t  bench_L[MAXBENCH];     // lengths of the benchmark
+int      bench_sweeps = 10;     // timed spin updates per case, in units of N
 
 /*External files*/
 FILE    //*in_file,        // input file
-        //*bk_file,        // back up file
-        *out_file;       // output file
+        *bk_file,        // back up file (checkpoint)
+        *out_file;       // output file (statistics, or swaps with parallel tempering)
+char    out_name[FILENAME_MAX];     // name of the output file
+uint8_t raw = 0,         // store every measure in output_file.raw
+        binary = 1,      // raw measures in binary (output.h), else text
+        resume = 0,      // continue the run from output_file.ckpt
+        hist = 0;        // store the (E, M) histogram of every block in output_file.hist
+int     ckpt_every = -1; // seconds between checkpoints (-1: none)
+time_t  ckpt_last;       // time of the last checkpoint
+
+/*Metrics*/
+typedef struct {
+    double   t[NPHASE];             // wall seconds of every phase
+    uint64_t cnt[NPHASE][NPERF],    // hardware counters of every phase
+             updates,               // updates (steps of the schedule)
+             spins,                 // spin updates: flipped spins for Wolff, visited sites for the others
+             clusters,              // clusters of Wolff and sw
+             cspins;                // and their spins
+} metrics_t;
+FILE    *met_file = NULL;           // metrics file, -m (NULL: no metrics)
+char    *met_name = NULL;           // and its name
+metrics_t met,                      // since the last line of the metrics file
+          met_total;                // of the whole run
+uint64_t chist[NHIST];              // Wolff clusters of 2^b to 2^(b+1)-1 spins so far
+int      phase = PH_THERM,          // current phase
+         perf_fd[NPERF] = {-1, -1, -1, -1, -1},    // counters of the main thread, the first open one leads the group
+         use_perf = 0;              // -P
+uint64_t perf_last[NPERF];          // counters at the start of the phase
+double   phase_start,               // wall time of the start of the phase
+         run_start;                 // and of the run
+const char *phase_names[NPHASE] = {"therm", "pilot", "update", "measure", "output", "checkpoint"};
+
+typedef struct {
+    char     magic[8];          // CKPT_MAGIC
+    uint32_t version,           // CKPT_VERSION
+             L,                 // parameters of the run, checked when resuming
+             nblock, nmeas, nupdte, ntherm;
+    float    kappa;
+    char     algorithm[12];
+    uint8_t  raw, binary, prng, bond, layout, dim,
+             mix, mixable,      // schedule of -A (nupdte is the chosen one once nt=ntherm)
+             hist,
+             metrics;           // -m, its accumulators follow hbuf
+    uint32_t nauto,
+             nthreads;          // PRNG streams after the header
+    uint64_t seed;
+    uint32_t nt, nb, nm,        // progress
+             nmeasured;
+    int64_t  E, M;              // kept by Wolff
+    uint32_t st_n, st_nb;       // measures in the current block and blocks of stats[0]
+    int64_t  out_pos, raw_pos,  // length of output_file and output_file.raw
+             hist_pos,          // and output_file.hist
+             met_pos;           // and the metrics file
+    double   met_wall;          // wall seconds of the run measured by the metrics
+} ckpt_header;                  // followed by the stream of every thread, lat, stats[0].sum, its block means, hbuf, and met, met_total and chist
+
+typedef struct {
+    prng_t   g;                 // rng of a thread
+    uint64_t buf[RNDBUF];       // its rnd_buf
+    uint32_t pos;               // and rnd_pos
+    uint64_t bond_buf[RNDBUF];  // its bond_buf
+    uint32_t bond_pos;          // and bond_pos
+    uint8_t  bond_bits;
+} ckpt_stream;
 
 /*--Predefinitions for better performance--*/
 /*iterators*/
 int16_t x, y;        // coords in lattice
-uint32_t i,          // current site in lattice (x+L*y)
+uint32_t i,          // current site in lattice (x+L*y in the rows layout)
          j, k;       // multi-purpose iterators
-uint8_t  nit;        // iterator for neighbours (up to 4)
+#pragma omp threadprivate(x, y, i)
 /*precalcs*/
 double invN,         // 1/N
        JinvN;        // J/N
@@ -62,188 +280,2008 @@ double invN,         // 1/N
 
 /*----FUNCTIONS----*/
 /*-----------------*/
+void Wolff();
+void SW();
+void metropolis();
+void set_kappa(float kp);
+void setup_chain();
+void read_jobs(const char *name);
+double wall_time();
+void load_checkpoint();
+void observables();
+extern const kernels_t generic_kernels, spec_kernels[][3], nd_kernels, spec3_kernels[];
+
 /*--PRNG--*/
-void xorshift64(){           // generates a PRNG in (0, 2^64-1]
-    rnd ^= rnd << 13;
-    rnd ^= rnd >> 7;
-    rnd ^= rnd << 17;
+void rand64(){               // next random number of this thread in rnd, generated RNDBUF at a time
+    if (rnd_pos == RNDBUF){
+        prng_fill(&rng, rnd_buf, RNDBUF);
+        rnd_pos = 0;
+    }
+    rnd = rnd_buf[rnd_pos++];
+}
+static inline int bond_test(){
+    /* 1 with probability 1-exp(-2k): bond_bits bits of bond_buf against prob_bond,
+     * so a 64-bit random number gives 2 or 4 tests when kappa allows it (set_bond_bits).
+     * The buffer is refilled RNDBUF random numbers at a time and shared by all bonds.
+     */
+    uint64_t r;
+    if (bond_pos >= (uint32_t) RNDBUF << bond_lg){
+        prng_fill(&rng, bond_buf, RNDBUF);
+        bond_pos = 0;
+    }
+    r = bond_buf[bond_pos >> bond_lg] >> ((bond_pos & ((1u << bond_lg) - 1)) * bond_bits);
+    bond_pos++;
+    if (bond_bits < 64) r &= (1ULL << bond_bits) - 1;
+    return r >= prob_bond;
+}
+uint64_t splitmix64(uint64_t z){     // scrambles z, used to seed and to hash
+    z += 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+uint64_t time_seed(){
+    /*default seed, from the time in ns and the process id so that runs started together get different ones*/
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return splitmix64(((uint64_t) t.tv_sec * 1000000000 + t.tv_nsec) ^ ((uint64_t) getpid() << 40));
+}
+void seed_stream(uint64_t seed, int thread){
+    /*stream number thread of the generator for seed, independent of the other threads*/
+    prng_seed(&rng, prng_kind, seed, thread);
+    rnd_pos = RNDBUF;
+    bond_pos = UINT32_MAX;
+}
+void set_bond_bits(uint8_t bits){
+    /*bits per bond test of this thread, the bond randoms left are dropped if it changes*/
+    if (bits != bond_bits){
+        bond_bits = bits;
+        bond_lg = (bits == 16) ? 2 : (bits == 32) ? 1 : 0;
+        bond_pos = UINT32_MAX;
+    }
+}
+int compare_floats(const void *a, const void *b){
+    return (*(float *) a > *(float *) b) - (*(float *) a < *(float *) b);
 }
 /*--init--*/
+void write_header(FILE *f, const char *magic, uint32_t record_size, float kp){
+    /*header of a binary file of the run at kappa kp*/
+    out_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, magic, sizeof(h.magic));
+    h.version = OUT_VERSION;
+    h.L = L;
+    h.kappa = kp;
+    h.seed = seed;
+    h.nblock = nblock;
+    h.nmeas = nmeas;
+    h.nupdte = nupdte;
+    h.ntherm = ntherm;
+    memcpy(h.algorithm, algorithm, sizeof(h.algorithm));     // same size, 0 terminated
+    h.record_size = record_size;
+    strcpy(h.prng, prng_names[prng_kind]);
+    h.dim = dim;
+    fwrite(&h, sizeof(h), 1, f);
+}
+FILE *open_output(const char *name, float kp){
+    /*output file of the measures at kappa kp with a large buffer, and the header if binary*/
+    FILE *f = fopen(name, "w");
+    if (!f){printf("ERROR: can't open %s\n", name); exit(1);}
+    setvbuf(f, NULL, _IOFBF, OUT_BUFFER);
+    if (binary) write_header(f, OUT_MAGIC, sizeof(out_record), kp);
+    return f;
+}
+FILE *open_stats(const char *name, float kp){
+    /*statistics file at kappa kp with the parameters of the run*/
+    FILE *f = fopen(name, "w");
+    if (!f){printf("ERROR: can't open %s\n", name); exit(1);}
+    char nu[8];
+    if (nauto) strcpy(nu, "auto");      // the schedule line follows the thermalization
+    else snprintf(nu, sizeof(nu), "%d", nupdte);
+    fprintf(f, "# L=%d dim=%d kappa=%.7f seed=%lu prng=%s algorithm=%s nblock=%d nmeas=%d nupdte=%s ntherm=%d\n",
+            L, dim, kp, seed, prng_names[prng_kind], algorithm, nblock, nmeas, nu, ntherm);
+    fprintf(f, "# block\te\t|m|\tm^2\tm^4\tC\tchi\tU\n");
+    return f;
+}
+int compare_L(const void *a, const void *b){
+    return (*(int16_t *) a > *(int16_t *) b) - (*(int16_t *) a < *(int16_t *) b);
+}
+int compare_jobs(const void *a, const void *b){
+    /*by L, then in the order of the job file*/
+    const job_t *ja = (const job_t *) a, *jb = (const job_t *) b;
+    if (ja->L != jb->L) return (ja->L > jb->L) - (ja->L < jb->L);
+    return (ja->id > jb->id) - (ja->id < jb->id);
+}
+void read_jobs(const char *name){
+    /*jobs of the job file, '#' starts a comment*/
+    FILE *f = fopen(name, "r");
+    char line[FILENAME_MAX+256], out[FILENAME_MAX], fmt[64];
+    int size = 16, nline = 0;
+    job_t jb;
+
+    if (!f){printf("ERROR: can't open %s\n", name); exit(1);}
+    snprintf(fmt, sizeof(fmt), "%%hd %%f %%hhu %%hu %%hu %%hu %%lu %%%ds", FILENAME_MAX-1);  // out can't overflow
+    jobs = (job_t*) malloc(sizeof(job_t) * size);
+    while (fgets(line, sizeof(line), f)){
+        nline++;
+        if (strchr(line, '#')) *strchr(line, '#') = '\0';
+        if (strspn(line, " \t\r\n") == strlen(line)) continue;      // empty line
+        if (sscanf(line, fmt, &jb.L, &jb.kappa, &jb.nblock, &jb.nmeas,
+                   &jb.nupdte, &jb.ntherm, &jb.seed, out) != 8){
+            printf("ERROR: %s:%d should be L kappa nblock nmeas nupdte ntherm seed output_file\n", name, nline); exit(1);
+        }
+        if (strlen(out) == FILENAME_MAX-1){printf("ERROR: %s:%d output_file is too long\n", name, nline); exit(1);}
+        if (jb.L<=1 || (jb.L&(jb.L-1))){printf("ERROR: %s:%d L must be 2^n with n>0\n", name, nline); exit(1);}
+        if (__builtin_ctz(jb.L)*dim > 30){printf("ERROR: %s:%d L^dim must be up to 2^30\n", name, nline); exit(1);}
+        if (layout != LAYOUT_ROWS && jb.L<8){printf("ERROR: %s:%d the %s layout needs L>=8\n", name, nline, layout_names[layout]); exit(1);}
+        if (jb.kappa<=0){printf("ERROR: %s:%d kappa must be positive\n", name, nline); exit(1);}
+        if (jb.nblock<2 || !jb.nmeas || !jb.nupdte){printf("ERROR: %s:%d nblock must be at least 2 (jackknife errors), nmeas and nupdte positive\n", name, nline); exit(1);}
+        if (!jb.seed) jb.seed = time_seed() + njob;
+        jb.out = strdup(out);
+        jb.id = njob;
+        if (njob == size){
+            size *= 2;
+            jobs = (job_t*) realloc(jobs, sizeof(job_t) * size);
+        }
+        if (!jobs || !jb.out){printf("ERROR: not enough memory for the jobs\n"); exit(1);}
+        jobs[njob++] = jb;
+    }
+    fclose(f);
+    if (!njob){printf("ERROR: no jobs in %s\n", name); exit(1);}
+    qsort(jobs, njob, sizeof(job_t), compare_jobs);
+}
 void get_data(int argc, char *argv[]){
     /*Get data from input (by now exec args, TODO entry file)*/
-    if (argc == 1 || argc > 7){
-        printf("Usage:\t %s L output_file [OPTIONAL] nblock nmeas nupdte ntherm kappa\n", argv[0]);
-        printf("default: nblock=20, nmeas=1000, nupdte=5, ntherm=10, kappa=0.4406868\n");
+    static struct option long_opts[] = {
+        {"algorithm", required_argument, 0, 'a'},
+        {"threads",   required_argument, 0, 't'},
+        {"kappas",    required_argument, 0, 'k'},
+        {"check",     required_argument, 0, 'c'},
+        {"format",    required_argument, 0, 'f'},
+        {"raw",       no_argument,       0, 'r'},
+        {"checkpoint",required_argument, 0, 's'},
+        {"resume",    no_argument,       0, 'R'},
+        {"jobs",      required_argument, 0, 'j'},
+        {"bench",     required_argument, 0, 'b'},
+        {"seed",      required_argument, 0, 'S'},
+        {"prng",      required_argument, 0, 'g'},
+        {"bond-bits", required_argument, 0, 'B'},
+        {"layout",    required_argument, 0, 'l'},
+        {"generic",   no_argument,       0, 'G'},
+        {"dim",       required_argument, 0, 'd'},
+        {"auto",      required_argument, 0, 'A'},
+        {"mix",       no_argument,       0, 'M'},
+        {"metrics",   required_argument, 0, 'm'},
+        {"perf",      no_argument,       0, 'P'},
+        {"histogram", no_argument,       0, 'H'},
+        {"ensemble",  required_argument, 0, 'e'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    char *tok;
+    while ((opt = getopt_long(argc, argv, "a:t:k:c:f:rs:Rj:b:S:g:B:l:Gd:A:Mm:PHe:", long_opts, NULL)) != -1){  // options go before the positional arguments
+        switch (opt){
+            case 'a': strncpy(algorithm, optarg, sizeof(algorithm)-1); break;
+            case 't': sscanf(optarg, "%d", &nthreads); break;
+            case 'k':
+                for (tok=strtok(optarg, ","); tok && nkappa<MAXKAPPAS; tok=strtok(NULL, ","))
+                    sscanf(tok, "%f", &kappas[nkappa++]);
+                break;
+            case 'c': sscanf(optarg, "%hu", &ncheck); break;
+            case 'f':
+                if      (!strcmp(optarg, "binary")) binary = 1;
+                else if (!strcmp(optarg, "text"))   binary = 0;
+                else argc = 0;
+                break;
+            case 'r': raw = 1; break;
+            case 'H': hist = 1; break;
+            case 's': sscanf(optarg, "%d", &ckpt_every); break;
+            case 'R': resume = 1; break;
+            case 'j': job_name = optarg; break;
+            case 'S': sscanf(optarg, "%lu", &seed); seed_given = 1; break;
+            case 'g':
+                if      (!strcmp(optarg, "xoshiro")) prng_kind = PRNG_XOSHIRO;
+                else if (!strcmp(optarg, "philox"))  prng_kind = PRNG_PHILOX;
+                else argc = 0;
+                break;
+            case 'B':
+                sscanf(optarg, "%hhu", &bond_force);
+                if (bond_force != 16 && bond_force != 32 && bond_force != 64) argc = 0;
+                break;
+            case 'l':
+                for (layout=0; layout<3 && strcmp(optarg, layout_names[layout]); layout++);
+                if (layout == 3) argc = 0;
+                layout_given = 1;
+                break;
+            case 'G': force_generic = 1; break;
+            case 'd':
+                sscanf(optarg, "%hhu", &dim);
+                if (dim < 2 || dim > MAXDIM) argc = 0;
+                break;
+            case 'A':
+                sscanf(optarg, "%hu", &nauto);
+                if (!nauto) argc = 0;
+                break;
+            case 'M': mixable = 1; break;
+            case 'm': met_name = optarg; break;
+            case 'P': use_perf = 1; break;
+            case 'e':
+                sscanf(optarg, "%d", &nchain);
+                if (nchain < 1 || nchain > MAXKAPPAS) argc = 0;
+                break;
+            case 'b':
+                for (tok=strtok(optarg, ","); tok && nbench<MAXBENCH; tok=strtok(NULL, ","))
+                    sscanf(tok, "%hd", &bench_L[nbench++]);
+                break;
+            default: argc = 0;                          // show usage
+        }
+    }
+    argc -= optind-1;           // positional arguments as if there were no options
+    argv += optind-1;
+
+    if (job_name ? argc != 1 : nbench ? (argc < 2 || argc > 3) : (argc < 3 || argc > 8)){
+        printf("Usage:\t %s [options] L output_file [OPTIONAL] nblock nmeas nupdte ntherm kappa\n", argv[0]);
+        printf("\t %s [options] -j job_file\n", argv[0]);
+        printf("\t %s [options] -b L1,L2,... output_file [OPTIONAL] sweeps\n", argv[0]);
+        printf("default: nblock=20, nmeas=1000, nupdte=5, ntherm=10, kappa=%.7f (critical, %.7f in 3D and %.7f in 4D)\n",
+               kappa_c[2], kappa_c[3], kappa_c[4]);
+        printf("options:\n");
+        printf("\t-a, --algorithm wolff|sw|metropolis  MC update (default wolff)\n");
+        printf("\t-t, --threads n           threads for sw, --jobs and --bench (compiled with -fopenmp), wolff and\n");
+        printf("\t                          metropolis only split the measures among them\n");
+        printf("\t-S, --seed n              seed of the random numbers (default: from the time and the process id)\n");
+        printf("\t-g, --prng xoshiro|philox xoshiro256** (default) or Philox4x32-10, one stream per thread\n");
+        printf("\t-B, --bond-bits 16|32|64  bits per bond test of wolff and sw (default: the fewest that give\n");
+        printf("\t                          1-exp(-2k) within 2^-32, 32 for almost every kappa)\n");
+        printf("\t-l, --layout rows|tiles|morton\n");
+        printf("\t                          sites of a 64-bit word: part of a row (default), an 8x8 tile\n");
+        printf("\t                          with tiles row by row, or 8x8 tiles in Z-order (L>=8, not sw)\n");
+        printf("\t-G, --generic             generic wolff, metropolis and measure kernels also for the L\n");
+        printf("\t                          with specialized ones (2^%d to 2^%d)\n", SPEC_SHIFT0, SPEC_SHIFT1);
+        printf("\t-d, --dim d               hypercubic lattice of L^d sites, d=2 (default) to %d, wolff and rows\n", MAXDIM);
+        printf("\t                          layout only for d>2, L^d up to 2^30\n");
+        printf("\t-A, --auto nmax           choose nupdte up to nmax (the argument is ignored) after the thermalization\n");
+        printf("\t                          from the tau_int and the cost of a pilot run, for the most independent\n");
+        printf("\t                          measures per second (single runs)\n");
+        printf("\t-M, --mix                 with -A also try a metropolis sweep after every update (wolff or sw, 2D)\n");
+        printf("\t-m, --metrics file        JSON lines with the wall time of every phase, spin updates per second, the\n");
+        printf("\t                          cluster size histogram (wolff) and counters of -P, at every block (single runs),\n");
+        printf("\t                          saved in the checkpoints so that -R goes on with the same totals\n");
+        printf("\t-P, --perf                with -m, cycles, instructions, cache references and misses and branch\n");
+        printf("\t                          misses of the update and measure phases (Linux perf_event_open)\n");
+        printf("\t-k, --kappas k1,k2,...    parallel tempering, one replica per kappa and thread,\n");
+        printf("\t                          output_file.k<kappa> for every kappa (no kappa argument)\n");
+        printf("\t-e, --ensemble K          K independent chains at kappa, one per thread with stream k of the seed,\n");
+        printf("\t                          the block statistics of every chain and of all of them merged in\n");
+        printf("\t                          output_file (wolff or metropolis, output_file.c<k>.raw with -r)\n");
+        printf("\t-r, --raw                 also store every measure in output_file.raw\n");
+        printf("\t-H, --histogram           store the joint (E, M) histogram of every block in output_file.hist\n");
+        printf("\t                          (single runs), to combine runs at other kappas with reweight.c\n");
+        printf("\t-c, --check K             recompute E and M from the lattice every K measures\n");
+        printf("\t                          and compare them with the ones kept by wolff\n");
+        printf("\t-f, --format binary|text  raw measures as E,M int64 records after a header (default,\n");
+        printf("\t                          see output.h and read_output.c) or as e,m text lines\n");
+        printf("\t-s, --checkpoint sec      save the run to output_file.ckpt every sec seconds\n");
+        printf("\t-R, --resume              continue the run from output_file.ckpt (same arguments and options, -m too)\n");
+        printf("\t-j, --jobs job_file       run the jobs of job_file on a pool of -t threads, one line per job:\n");
+        printf("\t                          L kappa nblock nmeas nupdte ntherm seed output_file (seed 0: time)\n");
+        printf("\t-b, --bench L1,L2,...     time wolff, sw and metropolis for every L, kappa of -k and layout\n");
+        printf("\t                          (all of them without -l)\n");
+        printf("\t                          (default 0.3,0.4406868,0.6) with a fixed seed (-S or %d), sweeps*N\n", BENCH_SEED);
+        printf("\t                          spin updates per case (default 10), output_file is JSON\n");
+        printf("\t                          if it ends in .json, else CSV\n");
+        printf("output_file: per block and overall <e>, <|m|>, <m^2>, <m^4>, C, chi and Binder U\n");
+        printf("\t     with jackknife errors and tau_int\n");
         exit(1);
     }
 
+    if      (!strcmp(algorithm, "wolff"))      update = Wolff;
+    else if (!strcmp(algorithm, "sw"))         update = SW;
+    else if (!strcmp(algorithm, "metropolis")) update = metropolis;
+    else {printf("ERROR: unknown algorithm %s\n", algorithm); exit(1);}
+    if (dim != 2 && layout != LAYOUT_ROWS){printf("ERROR: the %s layout is 2D\n", layout_names[layout]); exit(1);}
+    if (nthreads<0){printf("ERROR: threads must be positive\n"); exit(1);}
+
+    if (nbench){                                    // benchmark
+        if (job_name || ckpt_every>=0 || resume){printf("ERROR: a benchmark can't use --jobs, --checkpoint or --resume\n"); exit(1);}
+        for (k=0; k<nbench; k++)
+            if (bench_L[k]<=1 || (bench_L[k]&(bench_L[k]-1))){printf("ERROR: L must be 2^n with n>0\n"); exit(1);}
+            else if (layout != LAYOUT_ROWS && bench_L[k]<8){printf("ERROR: the %s layout needs L>=8\n", layout_names[layout]); exit(1);}
+            else if (__builtin_ctz(bench_L[k])*dim > 30){printf("ERROR: L^dim must be up to 2^30\n"); exit(1);}
+        if (!nkappa){                               // as in 2D, relative to the critical kappa
+            kappas[nkappa++] = 0.3 * kappa_c[dim]/kappa_c[2];
+            kappas[nkappa++] = kappa_c[dim];
+            kappas[nkappa++] = 0.6 * kappa_c[dim]/kappa_c[2];
+        }
+        for (k=0; k<nkappa; k++)
+            if (kappas[k]<=0){printf("ERROR: kappa (=J*beta with J=1) must be positive\n"); exit(1);}
+        snprintf(out_name, sizeof(out_name), "%s", argv[1]);
+        if (argc>=3) sscanf(argv[2], "%d", &bench_sweeps);
+        if (bench_sweeps<=0){printf("ERROR: sweeps must be positive\n"); exit(1);}
+        if (!seed_given) seed = BENCH_SEED;
+        out_file = fopen(out_name, "w");
+        if (!out_file){printf("ERROR: can't open %s\n", out_name); exit(1);}
+#ifdef _OPENMP
+        omp_set_dynamic(0);     // threadprivate PRNG states must survive between updates
+        if (nthreads) omp_set_num_threads(nthreads);
+#endif
+        return;
+    }
+    if (dim != 2 && update != Wolff){printf("ERROR: d>2 runs wolff\n"); exit(1);}
+    if ((nauto || mixable) && (job_name || nkappa || nchain)){printf("ERROR: --auto and --mix are for single runs\n"); exit(1);}
+    if (mixable && (!nauto || dim != 2 || update == metropolis)){printf("ERROR: --mix needs --auto and wolff or sw in 2D\n"); exit(1);}
+    if (hist && (job_name || nkappa || nchain)){printf("ERROR: --histogram is for single runs\n"); exit(1);}
+    if ((met_name && (job_name || nkappa || nchain)) || (use_perf && !met_name)){printf("ERROR: --metrics is for single runs and --perf needs it\n"); exit(1);}
+    if (met_name){
+        met_file = fopen(met_name, resume ? "a" : "w");
+        if (!met_file){printf("ERROR: can't open %s\n", met_name); exit(1);}
+    }
+
+    if (job_name){                                  // batch
+        if (nkappa || nchain || ckpt_every>=0 || resume){printf("ERROR: a batch can't use --kappas, --ensemble, --checkpoint or --resume\n"); exit(1);}
+        if (update == SW){printf("ERROR: a batch runs wolff or metropolis, one job per thread\n"); exit(1);}
+        read_jobs(job_name);
+#ifdef _OPENMP
+        omp_set_dynamic(0);     // every thread keeps its lattice between jobs
+        if (nthreads) omp_set_num_threads(nthreads);
+#endif
+        return;
+    }
+
     sscanf(argv[1], "%hd", &L);
-    out_file = fopen(argv[2], "w");
+    snprintf(out_name, sizeof(out_name), "%s", argv[2]);
     sscanf((argc>=4) ? argv[3] : "20", "%hhu", &nblock);        // set input if it exists elne default value
     sscanf((argc>=5) ? argv[4] : "1000", "%hu", &nmeas);
     sscanf((argc>=6) ? argv[5] : "5", "%hu", &nupdte);
     sscanf((argc>=7) ? argv[6] : "10", "%hu", &ntherm);
-    sscanf((argc>=8) ? argv[7] : "0.4406868", "%f", &kappa);
+    if (argc>=8) sscanf(argv[7], "%f", &kappa);
+    else kappa = kappa_c[dim];
 
+    if (!seed_given) seed = time_seed();
 
     if (L<=1 || (L&(L-1))){printf("ERROR: L must be 2^n with n>0\n"); exit(1);}
+    if (__builtin_ctz(L)*dim > 30){printf("ERROR: L^dim must be up to 2^30\n"); exit(1);}
     if (kappa<=0){printf("ERROR: kappa (=J*beta with J=1) must be positive\n"); exit(1);}
+    if (nblock<2 || !nmeas){printf("ERROR: nblock must be at least 2 (jackknife errors and tau_int) and nmeas positive\n"); exit(1);}
+    if (layout != LAYOUT_ROWS && (L<8 || update == SW)){printf("ERROR: the %s layout needs L>=8 and wolff or metropolis\n", layout_names[layout]); exit(1);}
+    if (nthreads>1 && (nkappa || nchain))
+        printf("WARNING: -t %d ignored, --kappas and --ensemble run one thread per replica or chain\n", nthreads);
+    else if (nthreads>1 && update != SW)
+        printf("WARNING: %s updates run on 1 thread, -t %d only splits the measures (sw, --ensemble or --jobs use the threads)\n", algorithm, nthreads);
+
+    if (nchain){                                    // ensemble
+        if (nkappa || ckpt_every>=0 || resume){printf("ERROR: an ensemble can't use --kappas, --checkpoint or --resume\n"); exit(1);}
+        if (update == SW){printf("ERROR: an ensemble runs wolff or metropolis, one chain per thread\n"); exit(1);}
+        out_file = open_stats(argv[2], kappa);
+        fprintf(out_file, "# ensemble of %d independent chains, chain k with stream k of the seed\n", nchain);
+        for (k=0; raw && k<nchain; k++){
+            char name[FILENAME_MAX];
+            snprintf(name, sizeof(name), "%s.c%d.raw", argv[2], k);
+            raw_file[k] = open_output(name, kappa);
+        }
+        nthreads = nchain;
+    }
+    else if (nkappa){                               // parallel tempering
+        if (ckpt_every>=0 || resume){printf("ERROR: checkpoints aren't available with parallel tempering\n"); exit(1);}
+        if (argc>=8) printf("WARNING: kappa %s ignored, using --kappas\n", argv[7]);
+        if (nkappa<2){printf("ERROR: parallel tempering needs at least 2 kappas\n"); exit(1);}
+        if (update == SW){printf("ERROR: parallel tempering runs wolff or metropolis\n"); exit(1);}
+        qsort(kappas, nkappa, sizeof(float), compare_floats);
+        for (k=0; k<nkappa; k++){
+            if (kappas[k]<=0){printf("ERROR: kappa (=J*beta with J=1) must be positive\n"); exit(1);}
+            char name[FILENAME_MAX];
+            snprintf(name, sizeof(name), "%s.k%.7f", argv[2], kappas[k]);
+            pt_file[k] = open_stats(name, kappas[k]);
+            if (raw) raw_file[k] = open_output(strcat(name, ".raw"), kappas[k]);
+        }
+        nthreads = nkappa;
+        out_file = fopen(argv[2], "w");             // swap statistics
+        if (!out_file){printf("ERROR: can't open %s\n", argv[2]); exit(1);}
+    }
+    else if (!resume){                              // else reopened from the checkpoint
+        out_file = open_stats(argv[2], kappa);
+        if (raw){
+            char name[FILENAME_MAX];
+            snprintf(name, sizeof(name), "%s.raw", argv[2]);
+            raw_file[0] = open_output(name, kappa);
+        }
+        if (hist){
+            char name[FILENAME_MAX];
+            snprintf(name, sizeof(name), "%s.hist", argv[2]);
+            hist_file = fopen(name, "w");
+            if (!hist_file){printf("ERROR: can't open %s\n", name); exit(1);}
+            setvbuf(hist_file, NULL, _IOFBF, OUT_BUFFER);
+            write_header(hist_file, HIST_MAGIC, sizeof(hist_entry), kappa);
+        }
+    }
+#ifdef _OPENMP
+    omp_set_dynamic(0);         // threadprivate PRNG states must survive between updates
+    if (nthreads) omp_set_num_threads(nthreads);
+#else
+    if (nkappa || nchain){printf("ERROR: parallel tempering and ensembles need OpenMP (compile with -fopenmp)\n"); exit(1);}
+#endif
 }
 
-void setup(){
-    /*--Remaining information--*/
-    N = L*L;
+static inline geom_t geometry(uint8_t lay, uint32_t Lk){
+    /* Sizes and bits of x and y in the site indices for the layout lay and L=Lk:
+     * rows y|x, tiles tile_y|tile_x|y%8|x%8, morton (tile_y,tile_x interleaved)|y%8|x%8.
+     * With constant arguments it folds into constants (the specialized kernels).
+     */
+    geom_t g;
+    g.N = Lk*Lk;
+    g.NW = (g.N+63)>>6;
+    g.txmask = (lay == LAYOUT_MORTON) ? 0x55555555 & (g.NW-1) : (Lk>>3) - 1;
+    g.tymask = (g.NW-1) & ~g.txmask;
+    g.xmask  = (lay == LAYOUT_ROWS) ? Lk-1 : (g.txmask << 6) | 7;
+    g.ymask  = (g.N-1) & ~g.xmask;
+    return g;
+}
+void setup_lattice(){
+    /*sizes and bits of x and y in the site indices for L and the layout, and the kernels for them, shared by all the chains*/
+    geom_t g = geometry(layout, L);
+    N = g.N;
+    NW = g.NW;
+    xmask = g.xmask; ymask = g.ymask;
+    txmask = g.txmask; tymask = g.tymask;
+    shift = 1;
     while (L>>(shift+1)){
         shift++;
     }
-    ntotal = ntherm + nblock*nmeas*nupdte;
+    if (dim != 2){                  // rows layout, coordinate k in bits k*shift to (k+1)*shift-1
+        N = 1u << (dim*shift);
+        NW = (N+63)>>6;
+    }
 
     /*--Predefinitions--*/
     int J=1;        //supposing J=1, else it should be input
     invN = (double) 1/N;
     JinvN = (double) J/N;
 
+    kern = (dim == 2) ? generic_kernels : nd_kernels;
+#ifndef NO_SPECIALIZE
+    if (!force_generic && dim == 2 && shift >= SPEC_SHIFT0 && shift <= SPEC_SHIFT1)
+        kern = spec_kernels[shift - SPEC_SHIFT0][layout];
+    if (!force_generic && dim == 3 && shift >= SPEC3_SHIFT0 && shift <= SPEC3_SHIFT1)
+        kern = spec3_kernels[shift - SPEC3_SHIFT0];
+#endif
+}
+uint32_t site(uint32_t xs, uint32_t ys){
+    /*index of the site (xs,ys) in the layout, the bits of xs and ys go to xmask and ymask*/
+    uint32_t s = 0, b;
+    for (b=1; b<N; b<<=1){
+        if (xmask & b){ if (xs & 1) s |= b; xs >>= 1; }
+        else          { if (ys & 1) s |= b; ys >>= 1; }
+    }
+    return s;
+}
+void setup(){
+    /*--Remaining information--*/
+    setup_lattice();
+    ntotal = ntherm + nblock*nmeas*nupdte;
+
     /*--PRNG--*/
-    prob_bond = (uint64_t) (exp(-2*kappa) * 0x1p+64);   // more precise than 1-exp(-2k)
-    rnd = (uint64_t) time(0);
+    #pragma omp parallel copyin(seed)
+    seed_stream(seed, omp_get_thread_num());
 
     /*--Lattice--*/
-    lat= (int8_t *) malloc(sizeof(char) * N);       // realocating memory
-    rn = (int16_t*) malloc(sizeof(short) * L);
-    ln = (int16_t*) malloc(sizeof(short) * L);
-    un = (int16_t*) malloc(sizeof(short) * L);
-    dn = (int16_t*) malloc(sizeof(short) * L);
-
-    for (i=0; i<N; i++){                            // set all spins to +1 or randomly
-        xorshift64();                               // some updates to the random number
-        lat[i] = +1;  //(rnd&1) * 2 - 1;
-    }
-    for (i=0; i<L; i++){                            // set relative neighbors
-        rn[i] = +1;     // right neighbour
-        ln[i] = -1;     // left neighbour
-        un[i] = L;      // up neighbour
-        dn[i] = -L;     // down neighbour
-    }
-    /*boundry conditions*/
-    ln[0] = L-1;
-    rn[L-1] = -ln[0];
-    dn[0] = (L-1)*L;
-    un[L-1] = -dn[0];
+    if (update == SW){
+        label = (uint32_t*) malloc(sizeof(uint32_t) * N);
+        bond = (uint8_t*) malloc(sizeof(uint8_t) * N);
+        if (!label || !bond){printf("ERROR: not enough memory for L=%d\n", L); exit(1);}
+    }
+    if (!nkappa) set_kappa(kappa);
+    if (!nkappa && !nchain)         // parallel tempering and ensembles set up one chain per thread
+        setup_chain();
+    for (k=0; k<(nkappa ? nkappa : nchain ? nchain : 1); k++){
+        stats[k].blk = (double*) malloc(sizeof(double) * NOBS * nblock);
+        if (!stats[k].blk){printf("ERROR: not enough memory for the statistics\n"); exit(1);}
+    }
+    if (hist){
+        hbuf = (out_record*) malloc(sizeof(out_record) * nmeas);
+        if (!hbuf){printf("ERROR: not enough memory for the histogram\n"); exit(1);}
+    }
+    if (resume) load_checkpoint();
+}
+void set_kappa(float kp){
+    /*kappa of this chain and its probabilities*/
+    kappa = kp;
+    /*bond tests of 16 or 32 bits if exp(-2k) rounded to them is within BOND_EPS, else 64*/
+    double p = exp(-2*kappa);                           // more precise than 1-exp(-2k)
+    uint8_t bits = bond_force;
+    for (int b=16; !bits && b<64; b*=2)
+        if (fabs(p - nearbyint(ldexp(p, b)) * ldexp(1, -b)) <= BOND_EPS) bits = b;
+    set_bond_bits(bits ? bits : 64);
+    prob_bond = (bond_bits == 64) ? prng_threshold(p) : (uint64_t) nearbyint(ldexp(p, bond_bits));
+    prob_metro[0] = UINT64_MAX;                         // never used, dE<=0 is always accepted
+    prob_metro[1] = prng_threshold(exp(-4*kappa));
+    prob_metro[2] = prng_threshold(exp(-8*kappa));
+}
+void setup_chain(){
+    /*lattice, cluster bitmap and cluster stack of this chain (of this thread), kept from the last one of the same L*/
+    if (chain_NW != NW){
+        free(lat); free(vis); free(stack); free(cword);
+        lat = (uint64_t*) malloc(sizeof(uint64_t) * NW);
+        vis = (uint64_t*) calloc(NW, sizeof(uint64_t));   // cleared by Wolff after every cluster
+        cword = (uint32_t*) malloc(sizeof(uint32_t) * NW);
+        sstack = (N < STACK0) ? N : STACK0;
+        stack = (uint32_t*) malloc(sizeof(uint32_t) * sstack);
+        if (!lat || !vis || !cword || !stack){printf("ERROR: not enough memory for L=%d\n", L); exit(1);}
+        chain_NW = NW;
+    }
+
+    for (i=0; i<NW; i++){                           // set all spins to +1 or randomly
+        rand64();                               // some updates to the random number
+        lat[i] = ~0ULL;  //rnd;
+    }
+    E = dim*(int64_t) N;            // all bonds satisfied
+    M = N;
+    nmeasured = 0;
 }
 /*--MC update--*/
-void expand_cluster(uint16_t x_cx, uint16_t y_cx, uint32_t i_cx){
-    /* we need to create new cluster expansion versions of x,y,i,n,nn variables
-     * which will be in different memory locations, one for each function call
-     */
-    uint8_t nit_cx;
-    int16_t nn_cx[4] = {rn[x_cx], ln[x_cx],
-                        un[y_cx], dn[y_cx]};
-    uint32_t n_cx;
-
-    for (nit_cx=0; nit_cx<4; nit_cx++){         // check all neighbours
-        n_cx = i_cx + nn_cx[nit_cx];
-        if (lat[n_cx] == spin){         // could be inside the cluster
-            xorshift64();
-            if (rnd > prob_bond){    // it is!
-                Ncs++;
-                lat[n_cx] = -spin;
-                expand_cluster(n_cx&(L-1), n_cx>>shift ,n_cx);   // now expand the cluster from it
+static inline __attribute__((always_inline)) void wolff_kernel(uint8_t lay, uint32_t Lk){
+    /* The cluster grows from an explicit stack instead of recursion, so near
+     * and above the critical point a cluster of ~N spins doesn't overflow the
+     * call stack. Every site is marked in vis when pushed, so it is pushed only
+     * once, and the whole cluster is flipped at the end as lat ^= vis over the
+     * words it touches (cword). E and M are updated from the cluster instead of measuring
+     * the whole lattice again: M changes by 2*Ncs and E by 2 for every bond
+     * leaving the cluster (-2 if it was satisfied, +2 if it wasn't).
+     * The sizes and masks below shadow the globals, constants in the specialized
+     * kernels, and so do the iterators, to keep them in registers.
+     */
+    const geom_t g = geometry(lay, Lk);
+    const uint32_t L = Lk, N = g.N, NW = g.NW, xmask = g.xmask, ymask = g.ymask, txmask = g.txmask, tymask = g.tymask;
+    const uint8_t layout = lay;
+    uint32_t i, n, nn[4];           // site, neighbour and the 4 neighbours (right, left, up, down)
+    uint8_t  nit;                   // iterator for neighbours
+    uint32_t w, wmin, wmax;         // words spanned by the cluster
+    uint64_t bit, smask;            // bit of a site in its word, ~0 if spin is +1 (lat^smask is 0 where lat==spin)
+    int64_t  dsat = 0;              // satisfied - unsatisfied bonds on the border of the cluster
+
+    rand64();                   // choose randomly the spin for the new cluster in [0,N)
+    i = (uint32_t) (((rnd>>32) * N) >> 32);
+
+    spin = SPIN(lat, i);            // save spin value for expansion
+    smask = spin ? ~0ULL : 0;
+    FLIP(vis, i);                   // mark it
+    Ncs = 1;
+    stack[0] = i;
+    nstack = 1;
+    wmin = wmax = cword[0] = i>>6;
+    ncword = 1;
+
+    while (nstack){                 // expand the cluster until no sites are left
+        i = stack[--nstack];
+        nn[0] = NEXT(i, xmask); nn[1] = PREV(i, xmask);
+        nn[2] = NEXT(i, ymask); nn[3] = PREV(i, ymask);
+
+        for (nit=0; nit<4; nit++){          // check all neighbours
+            n = nn[nit];
+            w = n>>6;
+            bit = 1ULL << (n&63);
+            if (!(((lat[w] ^ smask) | vis[w]) & bit)){     // same spin and not in the cluster yet
+                if (bond_test()){           // it is!
+                    Ncs++;
+                    if (!vis[w]) cword[ncword++] = w;
+                    vis[w] |= bit;
+                    if (nstack == sstack){
+                        sstack = (2*sstack < N) ? 2*sstack : N;
+                        stack = (uint32_t*) realloc(stack, sizeof(uint32_t) * sstack);
+                        if (!stack){printf("ERROR: not enough memory for the cluster stack\n"); exit(1);}
+                    }
+                    stack[nstack++] = n;    // expand from it later
+                    if (w < wmin) wmin = w;
+                    if (w > wmax) wmax = w;
+                }
             }
         }
     }
+
+    if (layout != LAYOUT_ROWS){     // 8x8 tiles, border bonds of the tiles of the cluster in the 4 directions
+        uint64_t v, nv, nl, cut;
+        for (uint32_t t=0; t<ncword; t++){
+            w = cword[t];
+            v = vis[w];
+            for (nit=0; nit<4; nit++){      // bit b of nv and nl is the neighbour of site b of w
+                switch (nit){
+                    case 0:  n = NEXT(w, txmask);
+                             nv = ((v >> 1) & ~COL7) | ((vis[n] & COL0) << 7);
+                             nl = ((lat[w] >> 1) & ~COL7) | ((lat[n] & COL0) << 7); break;
+                    case 1:  n = PREV(w, txmask);
+                             nv = ((v << 1) & ~COL0) | ((vis[n] & COL7) >> 7);
+                             nl = ((lat[w] << 1) & ~COL0) | ((lat[n] & COL7) >> 7); break;
+                    case 2:  n = NEXT(w, tymask);
+                             nv = (v >> 8) | (vis[n] << 56);
+                             nl = (lat[w] >> 8) | (lat[n] << 56); break;
+                    default: n = PREV(w, tymask);
+                             nv = (v << 8) | (vis[n] >> 56);
+                             nl = (lat[w] << 8) | (lat[n] >> 56);
+                }
+                cut = v & ~nv;
+                dsat += __builtin_popcountll(cut) - 2*__builtin_popcountll(cut & (lat[w] ^ nl));
+            }
+        }
+    }
+    else if (L >= 64 && 2*Ncs >= wmax - wmin + (L>>6)){  // big clusters, border bonds of the rows spanned as in measure()
+        uint32_t RW = L>>6,                         // words per row
+                 r0 = wmin / RW,                    // first and last row of the cluster
+                 nr = wmax / RW - r0 + 1;           // rows of the cluster
+        uint64_t cut, unsat;
+        if (nr < (uint32_t) L){                     // also the bonds to the row below
+            r0 = (r0 + L-1) & (L-1);
+            nr++;
+        }
+        for (uint32_t t=0, w0=r0*RW; t<nr*RW; t++){
+            w = (w0 + t) & (NW-1);
+            uint32_t wr = ((w+1) & (RW-1)) | (w & ~(RW-1)),     // next word in the row
+                     wu = (w+RW) & (NW-1);                      // word above
+            cut   = vis[w] ^ ((vis[w] >> 1) | (vis[wr] << 63));
+            unsat = lat[w] ^ ((lat[w] >> 1) | (lat[wr] << 63));
+            dsat += __builtin_popcountll(cut) - 2*__builtin_popcountll(cut & unsat);
+            cut   = vis[w] ^ vis[wu];
+            unsat = lat[w] ^ lat[wu];
+            dsat += __builtin_popcountll(cut) - 2*__builtin_popcountll(cut & unsat);
+        }
+    }
+    else {                          // small lattices or clusters, site by site from the cluster side
+        for (uint32_t t=0; t<ncword; t++){
+            w = cword[t];
+            for (bit=vis[w]; bit; bit&=bit-1){
+                i = (w<<6) + __builtin_ctzll(bit);
+                nn[0] = NEXT(i, xmask); nn[1] = PREV(i, xmask);
+                nn[2] = NEXT(i, ymask); nn[3] = PREV(i, ymask);
+                for (nit=0; nit<4; nit++){
+                    n = nn[nit];
+                    if (!SPIN(vis, n))
+                        dsat += (SPIN(lat, n) == spin) ? 1 : -1;
+                }
+            }
+        }
+    }
+    E -= 2*dsat;
+    M += spin ? -2*(int64_t) Ncs : 2*(int64_t) Ncs;
+
+    for (uint32_t t=0; t<ncword; t++){  // flip the cluster and clear vis
+        w = cword[t];
+        lat[w] ^= vis[w];
+        vis[w] = 0;
+    }
+}
+uint32_t find_root(uint32_t s){      // union-find root, halving the path
+    while (label[s] != s){
+        label[s] = label[label[s]];
+        s = label[s];
+    }
+    return s;
+}
+void unite(uint32_t a, uint32_t b){  // joins the clusters of a and b under the smallest root
+    a = find_root(a);
+    b = find_root(b);
+    if (a < b)      label[b] = a;
+    else if (b < a) label[a] = b;
+}
+void SW(){
+    /* Swendsen-Wang update in three parallel passes over row strips (rows layout), one per thread:
+     *  - bonds: every satisfied bond (right and up) is activated with probability 1-exp(-2k)
+     *  - labels: union-find inside every strip, then the up bonds of the last row of
+     *    every strip are merged by one thread
+     *  - flip: every cluster flips if a hash of its root and a random key is odd,
+     *    so no thread has to agree on the spin of a cluster with the others
+     */
+    static uint64_t key;        // random key of this update for the cluster flips
+    rand64();
+    key = rnd;
+    Nc = 0;
+
+    uint8_t bits = bond_bits;
+    #pragma omp parallel copyin(lat, prob_bond)
+    {
+    int t = omp_get_thread_num(), nt = omp_get_num_threads();
+    set_bond_bits(bits);
+    uint32_t s, r, ys, Nc_t = 0,
+             s0 = (uint32_t) (L*t/nt) << shift,         // first and last+1 sites of the strip
+             s1 = (uint32_t) (L*(t+1)/nt) << shift;
+
+    for (s=s0; s<s1; s++){                      // bonds
+        bond[s] = 0;
+        label[s] = s;
+        if (SPIN(lat, s) == SPIN(lat, NEXT(s, xmask)) && bond_test())
+            bond[s] |= 1;
+        if (SPIN(lat, s) == SPIN(lat, NEXT(s, ymask)) && bond_test())
+            bond[s] |= 2;
+    }
+    for (s=s0; s<s1; s++){                      // labels inside the strip
+        if (bond[s] & 1)
+            unite(s, NEXT(s, xmask));
+        if ((bond[s] & 2) && s+L < s1)          // up bond in the strip
+            unite(s, s + L);
+    }
+    #pragma omp barrier
+    #pragma omp single
+    for (r=0; r<(uint32_t) nt; r++){            // up bonds between strips (and around the lattice)
+        ys = L*(r+1)/nt - 1;                    // last row of strip r
+        for (s=ys<<shift; s<(ys+1)<<shift; s++)
+            if (bond[s] & 2)
+                unite(s, NEXT(s, ymask));
+    }
+    uint32_t w, b;
+    uint64_t mask;
+    for (w=NW*t/nt; w<NW*(t+1)/nt; w++){        // flip by whole words, so no word is shared (label[] only read from now on)
+        mask = 0;
+        for (b=0; b<64 && (w<<6|b)<N; b++){
+            s = r = w<<6|b;
+            while (label[r] != r)
+                r = label[r];
+            if (r == s) Nc_t++;
+            if (splitmix64(key ^ r) & 1)
+                mask |= 1ULL << b;
+        }
+        lat[w] ^= mask;
+    }
+    #pragma omp atomic
+    Nc += Nc_t;
+    }
 }
-void Wolff(){
-    xorshift64();                   // choose randomly the spin for the new cluster in (0,N)
-    frnd = (float) rnd * 0x1p-64;
-    i = (uint32_t) (frnd * N);
+static inline __attribute__((always_inline)) void metropolis_kernel(uint8_t lay, uint32_t Lk){
+    /*one typewriter Metropolis sweep (in the order of the layout), c antiparallel neighbours (c<2) cost exp(-4k*(2-c))*/
+    const geom_t g = geometry(lay, Lk);
+    const uint32_t N = g.N, xmask = g.xmask, ymask = g.ymask;
+    uint32_t i;
+    int c;
 
-    spin = lat[i];      // save spin value for expansion
-    lat[i] = -spin;     // flip the spin
-    expand_cluster(i&(L-1), i>>shift, i);  // expand the cluster
+    for (i=0; i<N; i++){
+        spin = SPIN(lat, i);
+        c = (SPIN(lat, NEXT(i, xmask)) ^ spin) + (SPIN(lat, PREV(i, xmask)) ^ spin) +
+            (SPIN(lat, NEXT(i, ymask)) ^ spin) + (SPIN(lat, PREV(i, ymask)) ^ spin);
+        if (c >= 2)
+            FLIP(lat, i);
+        else {
+            rand64();
+            if (rnd < prob_metro[2-c])
+                FLIP(lat, i);
+        }
+    }
+    Ncs = N;
 }
 /*--measurements--*/
-void measure() {
-    static int64_t E, M;    // should be a 64-bit integer since N is 32-bit unsigned integer
+static inline __attribute__((always_inline)) void measure_kernel(uint8_t lay, uint32_t Lk){
+    /* Spins up and unsatisfied bonds counted with popcount over whole words. For
+     * L>=64 every row is L/64 words: the right neighbours of a word are the word
+     * shifted by 1 bit with the first bit of the next word of the row (wrapping),
+     * the up neighbours are the word L/64 words ahead. In the tile layouts a word
+     * is an 8x8 tile: right neighbours are the word shifted by 1 bit with the first
+     * column of the tile to the right, up neighbours the word shifted by 8 bits
+     * with the first row of the tile above.
+     */
+    const geom_t g = geometry(lay, Lk);
+    const uint32_t L = Lk, N = g.N, NW = g.NW, xmask = g.xmask, ymask = g.ymask, txmask = g.txmask, tymask = g.tymask;
+    const uint8_t layout = lay;
+    int64_t up = 0, unsat = 0;      // should be a 64-bit integer since N is 32-bit unsigned integer
 
-    E = M = i = 0;      // reset measurements and site
-    for (y=0; y<L; y++) {
-        nn[1] = un[y];
-        for (x=0; x<L; x++){
-            spin = lat[i];
-            M += spin;
+    if (layout != LAYOUT_ROWS){
+        #pragma omp parallel for schedule(static) reduction(+:up,unsat) copyin(lat)
+        for (uint32_t w=0; w<NW; w++){
+            uint64_t right = ((lat[w] >> 1) & ~COL7) | ((lat[NEXT(w, txmask)] & COL0) << 7),
+                     above = (lat[w] >> 8) | (lat[NEXT(w, tymask)] << 56);
+            up    += __builtin_popcountll(lat[w]);
+            unsat += __builtin_popcountll(lat[w] ^ right) + __builtin_popcountll(lat[w] ^ above);
+        }
+    }
+    else if (L >= 64){
+        uint32_t RW = L>>6;         // words per row
+        #pragma omp parallel for schedule(static) reduction(+:up,unsat) copyin(lat)
+        for (uint32_t w=0; w<NW; w++){
+            uint64_t right = (lat[w] >> 1) | (lat[((w+1) & (RW-1)) | (w & ~(RW-1))] << 63);
+            up    += __builtin_popcountll(lat[w]);
+            unsat += __builtin_popcountll(lat[w] ^ right) +
+                     __builtin_popcountll(lat[w] ^ lat[(w+RW) & (NW-1)]);
+        }
+    }
+    else {                          // small lattices, site by site
+        for (uint32_t s=0; s<N; s++){
+            up    += SPIN(lat, s);
+            unsat += (SPIN(lat, s) ^ SPIN(lat, NEXT(s, xmask))) +
+                     (SPIN(lat, s) ^ SPIN(lat, NEXT(s, ymask)));
+        }
+    }
+    E = 2*(int64_t) N - 2*unsat;    // satisfied - unsatisfied bonds
+    M = 2*up - N;
+    observables();
+}
+/*kernels for any L and layout, from the globals*/
+void Wolff_generic()     { wolff_kernel(layout, L); }
+void metropolis_generic(){ metropolis_kernel(layout, L); }
+void measure_generic()   { measure_kernel(layout, L); }
+const kernels_t generic_kernels = {Wolff_generic, metropolis_generic, measure_generic};
+#ifndef NO_SPECIALIZE
+/*kernels with L=2^sh and the layout lay (0 rows, 1 tiles, 2 morton) as constants*/
+#define KERNELS(lay, sh) \
+    void Wolff_##lay##_##sh()     { wolff_kernel(lay, 1u << sh); } \
+    void metropolis_##lay##_##sh(){ metropolis_kernel(lay, 1u << sh); } \
+    void measure_##lay##_##sh()   { measure_kernel(lay, 1u << sh); }
+#define KERNELS_L(sh) KERNELS(0, sh) KERNELS(1, sh) KERNELS(2, sh)
+#define KENTRY(lay, sh) {Wolff_##lay##_##sh, metropolis_##lay##_##sh, measure_##lay##_##sh}
+#define KENTRY_L(sh) {KENTRY(0, sh), KENTRY(1, sh), KENTRY(2, sh)}
+KERNELS_L(6) KERNELS_L(7) KERNELS_L(8) KERNELS_L(9) KERNELS_L(10) KERNELS_L(11) KERNELS_L(12) KERNELS_L(13)
+const kernels_t spec_kernels[][3] = {   // [log_2(L)-SPEC_SHIFT0][layout]
+    KENTRY_L(6), KENTRY_L(7), KENTRY_L(8), KENTRY_L(9), KENTRY_L(10), KENTRY_L(11), KENTRY_L(12), KENTRY_L(13)
+};
+#endif
+/*--d-dimensional lattices--*/
+static inline __attribute__((always_inline)) void wolff_nd_kernel(uint8_t dk, uint32_t Lk){
+    /* Wolff on a hypercubic lattice of dk dimensions (rows layout): coordinate k of a
+     * site is in the bits k*log_2(L) to (k+1)*log_2(L)-1 of its index, so its 2*dk
+     * neighbours are NEXT and PREV with the mask of every coordinate, without
+     * neighbour lists. For L>=64 a word is part of a row and the border bonds are
+     * counted by whole words over cword: along x the word shifted by 1 bit with the
+     * first or last bit of the next or previous word of the row, along any other
+     * coordinate the word L^k/64 words away. Smaller L, site by site.
+     */
+    const uint8_t  sh = __builtin_ctz(Lk);
+    const uint32_t L = Lk, N = 1u << (dk*sh);
+    uint32_t mk[MAXDIM],            // mask of every coordinate
+             i, n, w, k;
+    uint64_t bit, smask, v, nv, nl, cut;
+    int64_t  dsat = 0;
+    for (k=0; k<dk; k++)
+        mk[k] = (Lk-1) << (k*sh);
+
+    rand64();                   // choose randomly the spin for the new cluster in [0,N)
+    i = (uint32_t) (((rnd>>32) * N) >> 32);
+
+    spin = SPIN(lat, i);
+    smask = spin ? ~0ULL : 0;
+    FLIP(vis, i);
+    Ncs = 1;
+    stack[0] = i;
+    nstack = 1;
+    cword[0] = i>>6;
+    ncword = 1;
 
-            nn[0] = rn[x];
-            for (nit=0; nit<2; nit++){
-                n = i + nn[nit];
-                E += spin * lat[n];
+    while (nstack){
+        i = stack[--nstack];
+        for (k=0; k<2*dk; k++){             // check all neighbours
+            n = (k&1) ? PREV(i, mk[k>>1]) : NEXT(i, mk[k>>1]);
+            w = n>>6;
+            bit = 1ULL << (n&63);
+            if (!(((lat[w] ^ smask) | vis[w]) & bit) && bond_test()){
+                Ncs++;
+                if (!vis[w]) cword[ncword++] = w;
+                vis[w] |= bit;
+                if (nstack == sstack){
+                    sstack = (2*sstack < N) ? 2*sstack : N;
+                    stack = (uint32_t*) realloc(stack, sizeof(uint32_t) * sstack);
+                    if (!stack){printf("ERROR: not enough memory for the cluster stack\n"); exit(1);}
+                }
+                stack[nstack++] = n;
+            }
+        }
+    }
+
+    if (L >= 64){
+        for (uint32_t t=0; t<ncword; t++){
+            w = cword[t];
+            v = vis[w];
+            for (k=0; k<2*dk; k++){         // bit b of nv and nl is the neighbour of site b of w
+                n = (k&1) ? PREV(w, mk[k>>1]>>6) : NEXT(w, mk[k>>1]>>6);
+                if (k == 0)     { nv = (v >> 1) | (vis[n] << 63); nl = (lat[w] >> 1) | (lat[n] << 63); }
+                else if (k == 1){ nv = (v << 1) | (vis[n] >> 63); nl = (lat[w] << 1) | (lat[n] >> 63); }
+                else            { nv = vis[n];                    nl = lat[n]; }
+                cut = v & ~nv;
+                dsat += __builtin_popcountll(cut) - 2*__builtin_popcountll(cut & (lat[w] ^ nl));
             }
-            i++;
         }
     }
+    else {
+        for (uint32_t t=0; t<ncword; t++){
+            w = cword[t];
+            for (v=vis[w]; v; v&=v-1){
+                i = (w<<6) + __builtin_ctzll(v);
+                for (k=0; k<2*dk; k++){
+                    n = (k&1) ? PREV(i, mk[k>>1]) : NEXT(i, mk[k>>1]);
+                    if (!SPIN(vis, n))
+                        dsat += (SPIN(lat, n) == spin) ? 1 : -1;
+                }
+            }
+        }
+    }
+    E -= 2*dsat;
+    M += spin ? -2*(int64_t) Ncs : 2*(int64_t) Ncs;
+
+    for (uint32_t t=0; t<ncword; t++){  // flip the cluster and clear vis
+        w = cword[t];
+        lat[w] ^= vis[w];
+        vis[w] = 0;
+    }
+}
+static inline __attribute__((always_inline)) void measure_nd_kernel(uint8_t dk, uint32_t Lk){
+    /*measure() of dk dimensions, by whole words as in wolff_nd_kernel for L>=64*/
+    const uint8_t  sh = __builtin_ctz(Lk);
+    const uint32_t L = Lk, N = 1u << (dk*sh), NW = (N+63)>>6;
+    uint32_t mk[MAXDIM], k;
+    int64_t  up = 0, unsat = 0;
+    for (k=0; k<dk; k++)
+        mk[k] = (Lk-1) << (k*sh);
+
+    if (L >= 64){
+        #pragma omp parallel for schedule(static) reduction(+:up,unsat) copyin(lat)
+        for (uint32_t w=0; w<NW; w++){
+            up    += __builtin_popcountll(lat[w]);
+            unsat += __builtin_popcountll(lat[w] ^ ((lat[w] >> 1) | (lat[NEXT(w, mk[0]>>6)] << 63)));
+            for (uint32_t q=1; q<dk; q++)
+                unsat += __builtin_popcountll(lat[w] ^ lat[NEXT(w, mk[q]>>6)]);
+        }
+    }
+    else {
+        for (uint32_t s=0; s<N; s++){
+            up += SPIN(lat, s);
+            for (k=0; k<dk; k++)
+                unsat += SPIN(lat, s) ^ SPIN(lat, NEXT(s, mk[k]));
+        }
+    }
+    E = dk*(int64_t) N - 2*unsat;   // satisfied - unsatisfied bonds
+    M = 2*up - N;
+    observables();
+}
+void Wolff_nd()  { wolff_nd_kernel(dim, L); }
+void measure_nd(){ measure_nd_kernel(dim, L); }
+const kernels_t nd_kernels = {Wolff_nd, NULL, measure_nd};
+#ifndef NO_SPECIALIZE
+/*3D kernels with L=2^sh as a constant*/
+#define KERNELS3(sh) \
+    void Wolff_3d_##sh()  { wolff_nd_kernel(3, 1u << sh); } \
+    void measure_3d_##sh(){ measure_nd_kernel(3, 1u << sh); }
+KERNELS3(4) KERNELS3(5) KERNELS3(6) KERNELS3(7) KERNELS3(8) KERNELS3(9)
+#define KENTRY3(sh) {Wolff_3d_##sh, NULL, measure_3d_##sh}
+const kernels_t spec3_kernels[] = {     // [log_2(L)-SPEC3_SHIFT0]
+    KENTRY3(4), KENTRY3(5), KENTRY3(6), KENTRY3(7), KENTRY3(8), KENTRY3(9)
+};
+#endif
+/*the kernels of L, dim and the layout*/
+void Wolff()     { kern.wolff(); }
+void metropolis(){ kern.metropolis(); }
+void measure()   { kern.measure(); }
+void observables(){
+    /*densities from E and M*/
     e  = (double) -JinvN * E;
     m  = (double) invN * M;
 }
+void take_measure(){
+    /* Wolff keeps E and M up to date, so the lattice is measured only every
+     * ncheck measures to check them. The other updates (and Wolff mixed with
+     * Metropolis sweeps, which don't track them) are measured every time.
+     */
+    int64_t E0 = E, M0 = M;
+
+    nmeasured++;
+    if (update != Wolff || mix)
+        measure();
+    else if (ncheck && nmeasured % ncheck == 0){
+        measure();
+        if (E != E0 || M != M0){
+            printf("ERROR: after %u measures E=%ld, M=%ld were kept but the lattice has E=%ld, M=%ld\n", nmeasured, E0, M0, E, M);
+            exit(1);
+        }
+    }
+    else
+        observables();
+}
+/*--statistics--*/
+void stats_add(stats_t *st){
+    /*last measure into the current block*/
+    double am = fabs(m), m2 = m*m;
+    st->sum[0] += e;
+    st->sum[1] += e*e;
+    st->sum[2] += am;
+    st->sum[3] += m2;
+    st->sum[4] += m2*m2;
+    st->n++;
+}
+void derived(const double *a, float kp, double *d){
+    /*reported observables d from the averages a of e, e^2, |m|, m^2, m^4*/
+    d[0] = a[0];
+    d[1] = a[2];
+    d[2] = a[3];
+    d[3] = a[4];
+    d[4] = kp*kp * N * (a[1] - a[0]*a[0]);    // specific heat per spin
+    d[5] = kp * N * (a[3] - a[2]*a[2]);       // susceptibility (with <|m|> for a finite lattice)
+    d[6] = 1 - a[4] / (3*a[3]*a[3]);          // Binder cumulant
+}
+void block_line(FILE *f, int b, const double *a, float kp, double *d){
+    /*line of block b with the means a, leaves its observables in d*/
+    derived(a, kp, d);
+    fprintf(f, "%d", b);
+    for (int q=0; q<NDER; q++) fprintf(f, "\t%.10g", d[q]);
+    fprintf(f, "\n");
+}
+void stats_block(stats_t *st, FILE *f, float kp, double *d){
+    /*closes the current block, writes its line to f (if not NULL) and leaves its observables in d*/
+    double *a = st->blk + NOBS*st->nb;
+    for (int o=0; o<NOBS; o++){
+        a[o] = st->sum[o] / st->n;
+        st->sum[o] = 0;
+    }
+    st->n = 0;
+    st->nb++;
+    if (f) block_line(f, st->nb, a, kp, d);
+    else derived(a, kp, d);
+}
+void stats_final(stats_t *st, FILE *f, float kp){
+    /* Overall observables from the block means with jackknife errors (leaving out
+     * one block at a time), and tau_int of e and |m| in measures from the
+     * variance of the block means, nmeas*var_block/(2*var), which holds while
+     * the blocks are much longer than tau_int.
+     */
+    static const char *name[NDER] = {"e", "|m|", "m^2", "m^4", "C", "chi", "U"};
+    int nb = st->nb, b, o, q;
+    double mean[NOBS] = {0}, jk[NOBS], d[NDER], dj[nb][NDER], djm[NDER] = {0}, err[NDER] = {0}, vb;
+
+    for (b=0; b<nb; b++)
+        for (o=0; o<NOBS; o++)
+            mean[o] += st->blk[NOBS*b+o] / nb;
+    derived(mean, kp, d);
+    for (b=0; b<nb; b++){
+        for (o=0; o<NOBS; o++)
+            jk[o] = (nb*mean[o] - st->blk[NOBS*b+o]) / (nb-1);
+        derived(jk, kp, dj[b]);
+        for (q=0; q<NDER; q++) djm[q] += dj[b][q] / nb;
+    }
+    for (b=0; b<nb; b++)
+        for (q=0; q<NDER; q++)
+            err[q] += (dj[b][q] - djm[q]) * (dj[b][q] - djm[q]);
+
+    fprintf(f, "# overall\tvalue\tjackknife error\n");
+    for (q=0; q<NDER; q++)
+        fprintf(f, "%s\t%.10g\t%.3g\n", name[q], d[q], sqrt(err[q] * (nb-1) / nb));
+
+    fprintf(f, "# tau_int (measures of %d updates%s)\n", nupdte, mix ? " and metropolis sweeps" : "");
+    for (o=0; o<4; o+=2){                       // e and |m|, followed by their squares
+        vb = 0;
+        for (b=0; b<nb; b++)
+            vb += (st->blk[NOBS*b+o] - mean[o]) * (st->blk[NOBS*b+o] - mean[o]) / (nb-1);
+        fprintf(f, "tau_%s\t%.4g\n", name[o/2], nmeas * vb / (2 * (mean[o+1] - mean[o]*mean[o])));
+    }
+}
 /*--output--*/
-void disp_lattice(int8_t *lattice) {
-    for (j=0; j<N; j++){
-        if ((j & (L-1)) == 0) puts("");     // new line
-        if (lattice[j]&1){
-            if (lattice[j]==1) printf("+");
+void write_measure(FILE *f){
+    /*last measure as a binary record (exact E and M) or as a text line*/
+    if (binary){
+        out_record rec = {E, M};
+        fwrite(&rec, sizeof(rec), 1, f);
+    }
+    else
+        fprintf(f, "\n%6.4f\t%6.4f", e, m);
+}
+int compare_records(const void *a, const void *b){
+    /*by E, then by M*/
+    const out_record *ra = (const out_record *) a, *rb = (const out_record *) b;
+    if (ra->E != rb->E) return (ra->E > rb->E) - (ra->E < rb->E);
+    return (ra->M > rb->M) - (ra->M < rb->M);
+}
+void hist_block_write(uint32_t block, uint32_t n){
+    /*histogram of the n measures of hbuf as the entries of block, hbuf sorted in place*/
+    hist_block hb = {block, 0};
+    hist_entry he;
+    uint32_t r, s;
+    qsort(hbuf, n, sizeof(out_record), compare_records);
+    for (r=0; r<n; r=s){
+        for (s=r+1; s<n && hbuf[s].E == hbuf[r].E && hbuf[s].M == hbuf[r].M; s++);
+        hb.n++;
+    }
+    fwrite(&hb, sizeof(hb), 1, hist_file);
+    for (r=0; r<n; r=s){
+        for (s=r+1; s<n && hbuf[s].E == hbuf[r].E && hbuf[s].M == hbuf[r].M; s++);
+        he.E = hbuf[r].E;
+        he.M = hbuf[r].M;
+        he.count = s - r;
+        fwrite(&he, sizeof(he), 1, hist_file);
+    }
+}
+void disp_lattice(uint64_t *lattice) {
+    for (y=0; y<L; y++){
+        puts("");                           // new line
+        for (x=0; x<L; x++){
+            if (SPIN(lattice, site(x, y))) printf("+");
             else printf("-");
         }
-        else {
-            if (lattice[j]==0) printf("o");
-            else printf(".");
-        }
     }
     puts("");
 }
 void disp_init_info() {
-    printf("total steps: %lu\nthermalization steps: %d\nmeasures: %d\nparticles: %d\nkappa: %.7f ", ntotal, ntherm, nblock*nmeas, N, kappa);
-    if (kappa - log(1+sqrt(2))/2 < 1e-10)    printf("(near critical point ");
-    else if (kappa < log(1+sqrt(2))/2)      printf("(below critical point ");
+    printf("algorithm: %s", algorithm);
+    if (update == SW) printf(" (%d threads)", omp_get_max_threads());
+    printf("\nseed: %lu (%s)\nlattice: %d^%d, layout %s (%s kernels)\n", seed, prng_names[prng_kind], L, dim, layout_names[layout],
+           (kern.wolff == Wolff_generic || kern.wolff == Wolff_nd) ? "generic" : "specialized");
+    if (update != metropolis && !nkappa) printf("bond tests: %d bits\n", bond_bits);
+    if (nchain) printf("ensemble: %d independent chains, one per thread (streams 0 to %d of the seed)\n", nchain, nchain-1);
+    if (nkappa){
+        printf("parallel tempering: %d replicas, kappas:", nkappa);
+        for (k=0; k<nkappa; k++) printf(" %.7f", kappas[k]);
+        printf("\ntotal steps per replica: %lu\nthermalization steps: %d\nmeasures per kappa: %d\nparticles: %d\n\n", ntotal, ntherm, nblock*nmeas, N);
+        return;
+    }
+    printf("total steps%s: %lu\nthermalization steps: %d\nmeasures%s: %d\nparticles: %d\nkappa: %.7f ",
+           nchain ? " per chain" : "", ntotal, ntherm, nchain ? " per chain" : "", nblock*nmeas, N, kappa);
+    if (fabs(kappa - kappa_c[dim]) < 1e-6)  printf("(near critical point ");
+    else if (kappa < kappa_c[dim])          printf("(below critical point ");
     else                                    printf("(above critical point ");
-    printf("log(1+sqrt(2))/2 = 0.4406868..)\n\n");
+    if (dim == 2) printf("log(1+sqrt(2))/2 = 0.4406868..)\n\n");
+    else          printf("%.7f in %dD)\n\n", kappa_c[dim], dim);
+}
+
+/*--parallel tempering--*/
+void swap_replicas(int r){
+    /* Called by every replica r (thread) after a measure. One thread tries to swap
+     * the replicas at neighbouring kappas k, k+1 (even k one time, odd the next),
+     * accepted with min(1, exp((k_{k+1}-k_k) * (E_k - E_{k+1}))). The randoms
+     * come from pt_rng, so the replicas' streams don't depend on which thread
+     * gets to the single first and a fixed seed reproduces the run.
+     */
+    static int parity = 0;
+    int kp, a;
+    uint64_t u;
+    double d;
+
+    pt_E[pt_kappa[r]] = E;
+    #pragma omp barrier
+    #pragma omp single
+    {
+    for (kp=parity; kp+1<nkappa; kp+=2){
+        pt_tries[kp]++;
+        d = (kappas[kp+1] - kappas[kp]) * (double) (pt_E[kp] - pt_E[kp+1]);
+        prng_fill(&pt_rng, &u, 1);
+        if (d >= 0 || u * 0x1p-64 < exp(d)){
+            a = pt_replica[kp];
+            pt_replica[kp] = pt_replica[kp+1];
+            pt_replica[kp+1] = a;
+            pt_kappa[pt_replica[kp]] = kp;
+            pt_kappa[a] = kp+1;
+            pt_accept[kp]++;
+        }
+    }
+    parity ^= 1;
+    }
+    set_kappa(kappas[pt_kappa[r]]);
+}
+void run_pt(){
+    /*Replica exchange: every thread runs one lattice and writes its measures to the file of the kappa it holds*/
+    uint8_t nbdisp = nblock/NBLCKDISP;
+    if (nbdisp == 0) nbdisp = 1;
+
+    for (k=0; k<nkappa; k++)
+        pt_kappa[k] = pt_replica[k] = k;
+    prng_seed(&pt_rng, prng_kind, seed, nkappa);    // the replicas have streams 0 to nkappa-1
+
+    printf("Beginning thermalization and measures\n");
+    #pragma omp parallel num_threads(nkappa) copyin(nblock, nmeas, nupdte, ntherm)
+    {
+    int r = omp_get_thread_num(), nt, nb, nm, nu;
+    double d[NDER];
+
+    set_kappa(kappas[r]);
+    setup_chain();
+    for (nt=0; nt<ntherm; nt++){
+        update();
+        if ((nt+1)%nupdte == 0){
+            take_measure();
+            swap_replicas(r);
+        }
+    }
+    for (nb=0; nb<nblock; nb++){
+        for (nm=0; nm<nmeas; nm++){
+            for (nu=0; nu<nupdte; nu++)
+                update();
+            take_measure();
+            stats_add(&stats[pt_kappa[r]]);
+            if (raw) write_measure(raw_file[pt_kappa[r]]);
+            swap_replicas(r);
+        }
+        stats_block(&stats[pt_kappa[r]], pt_file[pt_kappa[r]], kappas[pt_kappa[r]], d);
+        if (r == 0 && (nb%nbdisp == 0 || nb == nblock-1))
+            printf("%3.0f%%\n", (float) (nb+1)/nblock*100);
+    }
+    }
+
+    printf("Measures finished!\nswap acceptance:\n");
+    fprintf(out_file, "kappa_k\tkappa_k+1\tswaps\taccepted");
+    for (k=0; k+1<nkappa; k++){
+        printf("%.7f <-> %.7f: %5.1f%%\n", kappas[k], kappas[k+1], (float) pt_accept[k]/pt_tries[k]*100);
+        fprintf(out_file, "\n%.7f\t%.7f\t%lu\t%lu", kappas[k], kappas[k+1], pt_tries[k], pt_accept[k]);
+    }
+    for (k=0; k<nkappa; k++){
+        stats_final(&stats[k], pt_file[k], kappas[k]);
+        fclose(pt_file[k]);
+        if (raw) fclose(raw_file[k]);
+    }
+    fclose(out_file);
+}
+
+/*--ensemble--*/
+void run_ensemble(){
+    /* nchain chains at kappa, one per thread with the stream of that thread
+     * (setup), so they share only the read-only tables of L. Every chain keeps
+     * its block means; at the end they are written chain by chain with their
+     * overall values, followed by the overall values of all the blocks together,
+     * whose jackknife errors hold as the chains are independent.
+     */
+    uint8_t nbdisp = nblock/NBLCKDISP;
+    stats_t all = {{0}, NULL, 0, 0};
+    double d[NDER], mean[NOBS], t;
+    int c, b, o;
+    if (nbdisp == 0) nbdisp = 1;
+
+    printf("Beginning thermalization and measures\n");
+    t = wall_time();
+    #pragma omp parallel num_threads(nchain) copyin(nblock, nmeas, nupdte, ntherm, kappa)
+    {
+    int ch = omp_get_thread_num(), nt, nb, nm, nu;
+    double dl[NDER];
+
+    set_kappa(kappa);
+    setup_chain();
+    for (nt=0; nt<ntherm; nt++)
+        update();
+    for (nb=0; nb<nblock; nb++){
+        for (nm=0; nm<nmeas; nm++){
+            for (nu=0; nu<nupdte; nu++)
+                update();
+            take_measure();
+            stats_add(&stats[ch]);
+            if (raw) write_measure(raw_file[ch]);
+        }
+        stats_block(&stats[ch], NULL, kappa, dl);
+        if (ch == 0 && (nb%nbdisp == 0 || nb == nblock-1))
+            printf("%3.0f%%\n", (float) (nb+1)/nblock*100);
+    }
+    }
+    t = wall_time() - t;
+    printf("Measures finished!\n%d chains in %.3f s: %.4g updates/s, %.4g measures/s\n\n",
+           nchain, t, (double) nchain*ntotal/t, (double) nchain*nblock*nmeas/t);
+
+    all.blk = (double*) malloc(sizeof(double) * NOBS * nchain * nblock);
+    if (!all.blk){printf("ERROR: not enough memory for the statistics\n"); exit(1);}
+    printf("chain\te\t\t|m|\t\tU\n");
+    for (c=0; c<nchain; c++){
+        fprintf(out_file, "# chain %d\n", c);
+        for (o=0; o<NOBS; o++) mean[o] = 0;
+        for (b=0; b<stats[c].nb; b++){
+            block_line(out_file, b+1, stats[c].blk + NOBS*b, kappa, d);
+            for (o=0; o<NOBS; o++) mean[o] += stats[c].blk[NOBS*b+o] / stats[c].nb;
+        }
+        stats_final(&stats[c], out_file, kappa);
+        derived(mean, kappa, d);
+        printf("%d\t%.8f\t%.8f\t%.6f\n", c, d[0], d[1], d[6]);
+        memcpy(all.blk + NOBS*all.nb, stats[c].blk, sizeof(double) * NOBS * stats[c].nb);
+        all.nb += stats[c].nb;
+        if (raw) fclose(raw_file[c]);
+    }
+    fprintf(out_file, "# merged: %d chains of %d blocks\n", nchain, nblock);
+    printf("\nmerged: %d chains of %d blocks\n", nchain, nblock);
+    stats_final(&all, out_file, kappa);
+    stats_final(&all, stdout, kappa);
+    fclose(out_file);
+    free(all.blk);
+}
+
+/*--batch--*/
+void run_job(job_t *jb){
+    /*one job of the batch on this thread, with its own PRNG stream from its seed*/
+    stats_t st = {{0}, NULL, 0, 0};
+    FILE *f, *fraw = NULL;
+    char name[FILENAME_MAX+8];
+    double d[NDER];
+    int nt, nb, nm, nu;
+
+    nblock = jb->nblock; nmeas = jb->nmeas; nupdte = jb->nupdte; ntherm = jb->ntherm;
+    seed = jb->seed;
+    seed_stream(seed, 0);
+    set_kappa(jb->kappa);
+    setup_chain();
+    st.blk = (double*) malloc(sizeof(double) * NOBS * nblock);
+    if (!st.blk){printf("ERROR: not enough memory for the statistics\n"); exit(1);}
+    f = open_stats(jb->out, kappa);
+    if (raw){
+        snprintf(name, sizeof(name), "%s.raw", jb->out);
+        fraw = open_output(name, kappa);
+    }
+
+    for (nt=0; nt<ntherm; nt++)
+        update();
+    for (nb=0; nb<nblock; nb++){
+        for (nm=0; nm<nmeas; nm++){
+            for (nu=0; nu<nupdte; nu++)
+                update();
+            take_measure();
+            stats_add(&st);
+            if (raw) write_measure(fraw);
+        }
+        stats_block(&st, f, kappa, d);
+    }
+    stats_final(&st, f, kappa);
+    fclose(f);
+    if (raw) fclose(fraw);
+    free(st.blk);
+}
+void run_batch(){
+    /* The jobs of the same L run together on the pool of threads, the neighbour
+     * tables are set up once for them and every thread keeps its lattice for its
+     * next job. Jobs are handed out one at a time, so long and short runs balance.
+     */
+    int a, b, done = 0;
+
+    printf("algorithm: %s\nprng: %s\nbatch: %d jobs from %s on %d threads\n\n", algorithm, prng_names[prng_kind], njob, job_name, omp_get_max_threads());
+    for (a=0; a<njob; a=b){
+        for (b=a; b<njob && jobs[b].L == jobs[a].L; b++);
+        L = jobs[a].L;
+        setup_lattice();
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (int q=a; q<b; q++){
+            run_job(&jobs[q]);
+            #pragma omp critical
+            printf("%3d/%d done: L=%d kappa=%.7f -> %s\n", ++done, njob, L, jobs[q].kappa, jobs[q].out);
+        }
+    }
+}
+
+/*--benchmark--*/
+double wall_time(){
+    /*seconds from a monotonic clock*/
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+void reset_peak_rss(){
+    /*resets the peak resident memory of the process (Linux only, else it is the peak so far)*/
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f){
+        fputs("5", f);
+        fclose(f);
+    }
+}
+long peak_rss(){
+    /*peak resident memory in kB*/
+    char line[256];
+    long kb = -1;
+    struct rusage ru;
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f){
+        while (fgets(line, sizeof(line), f))
+            if (sscanf(line, "VmHWM: %ld", &kb) == 1) break;
+        fclose(f);
+    }
+    if (kb < 0 && !getrusage(RUSAGE_SELF, &ru)) kb = ru.ru_maxrss;
+    return kb;
+}
+void run_bench(){
+    /* Every algorithm for every L and kappa, from a +1 lattice and the same seed:
+     * 10*N spin updates to thermalize and bench_sweeps*N timed ones. A spin update
+     * is a flipped spin for Wolff and a visited site for sw and metropolis. The
+     * mean cluster size is Ncs for Wolff and N/Nc for sw. Without -l wolff and
+     * metropolis run in every layout (sw only in rows). For -d>2 only wolff runs.
+     */
+    static void (*algs[3])() = {Wolff, SW, metropolis};
+    static const char *names[3] = {"wolff", "sw", "metropolis"};
+    size_t len = strlen(out_name);
+    int json = len >= 5 && !strcmp(out_name + len-5, ".json"), first = 1, a, b, q, lo, lg = layout;
+    uint64_t sites, nupd, clusters;
+    double t, cluster;
+    long rss;
+
+    qsort(bench_L, nbench, sizeof(int16_t), compare_L);     // smaller lattices first
+    printf("benchmark: %dD, %d lengths, %d kappas, %d sweeps per case, %d threads for sw, seed %lu (%s), %s kernels\n\n",
+           dim, nbench, nkappa, bench_sweeps, omp_get_max_threads(), seed, prng_names[prng_kind],
+           force_generic ? "generic" : "specialized");
+    printf("algorithm  layout     L      kappa      flips/ns  updates/s   mean cluster  peak RSS (kB)\n");
+    if (json)
+        fprintf(out_file, "{\n  \"dim\": %d,\n  \"seed\": %lu,\n  \"prng\": \"%s\",\n  \"sweeps\": %d,\n  \"threads\": %d,\n  \"generic\": %s,\n  \"results\": [",
+                dim, seed, prng_names[prng_kind], bench_sweeps, omp_get_max_threads(), force_generic ? "true" : "false");
+    else
+        fprintf(out_file, "algorithm,layout,L,dim,kappa,threads,updates,seconds,flips_per_ns,updates_per_s,mean_cluster,peak_rss_kb\n");
+
+    for (b=0; b<nbench; b++){
+        L = bench_L[b];
+        setup_lattice();
+        label = (uint32_t*) realloc(label, sizeof(uint32_t) * N);
+        bond = (uint8_t*) realloc(bond, sizeof(uint8_t) * N);
+        if (!label || !bond){printf("ERROR: not enough memory for L=%d\n", L); exit(1);}
+        for (a=0; a<3; a++)
+        for (lo=0; lo<3; lo++){
+            if ((layout_given && lo != lg) || (lo != LAYOUT_ROWS && (L<8 || algs[a] == SW)) ||
+                (dim != 2 && (lo != LAYOUT_ROWS || algs[a] != Wolff))) continue;
+            update = algs[a];
+            layout = lo;
+            setup_lattice();
+            for (q=0; q<nkappa; q++){
+                reset_peak_rss();
+                #pragma omp parallel copyin(seed)
+                seed_stream(seed, omp_get_thread_num());
+                set_kappa(kappas[q]);
+                setup_chain();
+
+                for (sites=0; sites < 10*(uint64_t) N; sites += (update == Wolff) ? Ncs : N)
+                    update();
+                t = wall_time();
+                for (sites=0, nupd=0, clusters=0; sites < bench_sweeps*(uint64_t) N; nupd++){
+                    update();
+                    sites += (update == Wolff) ? Ncs : N;
+                    clusters += (update == SW) ? Nc : 1;
+                }
+                t = wall_time() - t;
+                rss = peak_rss();
+                cluster = (update == metropolis) ? NAN : (double) sites/clusters;
+
+                printf("%-10s %-8s %5d  %.7f  %8.4f  %10.1f  %13.1f  %ld\n", names[a], layout_names[lo], L, kappas[q], sites/t*1e-9, nupd/t, cluster, rss);
+                if (json){
+                    fprintf(out_file, "%s\n    {\"algorithm\": \"%s\", \"layout\": \"%s\", \"L\": %d, \"kappa\": %.7f, \"updates\": %lu, "
+                            "\"seconds\": %.6f, \"flips_per_ns\": %.6f, \"updates_per_s\": %.3f, \"mean_cluster\": ",
+                            first ? "" : ",", names[a], layout_names[lo], L, kappas[q], nupd, t, sites/t*1e-9, nupd/t);
+                    if (update == metropolis) fprintf(out_file, "null");
+                    else fprintf(out_file, "%.3f", cluster);
+                    fprintf(out_file, ", \"peak_rss_kb\": %ld}", rss);
+                }
+                else {
+                    fprintf(out_file, "%s,%s,%d,%d,%.7f,%d,%lu,%.6f,%.6f,%.3f,", names[a], layout_names[lo], L, dim, kappas[q],
+                            (update == SW) ? omp_get_max_threads() : 1, nupd, t, sites/t*1e-9, nupd/t);
+                    if (update != metropolis) fprintf(out_file, "%.3f", cluster);
+                    fprintf(out_file, ",%ld\n", rss);
+                }
+                first = 0;
+            }
+        }
+    }
+    if (json) fprintf(out_file, "\n  ]\n}\n");
+    fclose(out_file);
+}
+
+/*--metrics--*/
+void perf_setup(){
+    /* Counters of the main thread in one group (read at once), in user space. In
+     * containers and with perf_event_paranoid>2 they're usually not allowed, and
+     * the metrics go on without them.
+     */
+#ifdef __linux__
+    static const uint64_t config[NPERF] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    struct perf_event_attr a;
+    int c, lead = -1, nopen = 0;
+    for (c=0; c<NPERF; c++){
+        memset(&a, 0, sizeof(a));
+        a.size = sizeof(a);
+        a.type = PERF_TYPE_HARDWARE;
+        a.config = config[c];
+        a.disabled = (lead < 0);
+        a.exclude_kernel = 1;
+        a.exclude_hv = 1;
+        a.read_format = PERF_FORMAT_GROUP;
+        perf_fd[c] = syscall(__NR_perf_event_open, &a, 0, -1, lead, 0);
+        if (perf_fd[c] >= 0){
+            if (lead < 0) lead = perf_fd[c];
+            nopen++;
+        }
+    }
+    if (lead >= 0){
+        ioctl(lead, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(lead, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    if (nopen < NPERF) printf("WARNING: %d of %d hardware counters available (perf_event_paranoid?)\n", nopen, NPERF);
+    use_perf = (nopen > 0);
+#else
+    printf("WARNING: hardware counters need Linux\n");
+    use_perf = 0;
+#endif
+}
+void perf_read(uint64_t *v){
+    /*counters now, in the order of perf_fd (0 for the ones not open)*/
+    uint64_t g[NPERF+1];
+    int c, r = 0, lead;
+    for (lead=0; lead<NPERF && perf_fd[lead] < 0; lead++);
+    memset(v, 0, sizeof(uint64_t) * NPERF);
+    if (lead == NPERF || read(perf_fd[lead], g, sizeof(g)) < (ssize_t) sizeof(uint64_t)) return;
+    for (c=0; c<NPERF; c++)
+        if (perf_fd[c] >= 0 && ++r <= (int) g[0]) v[c] = g[r];
+}
+void phase_to(int ph){
+    /*closes the current phase into met and starts ph*/
+    double t;
+    uint64_t v[NPERF];
+    if (!met_file) return;
+    t = wall_time();
+    met.t[phase] += t - phase_start;
+    phase_start = t;
+    if (use_perf){
+        perf_read(v);
+        for (int c=0; c<NPERF; c++){
+            met.cnt[phase][c] += v[c] - perf_last[c];
+            perf_last[c] = v[c];
+        }
+    }
+    phase = ph;
+}
+void count_update(){
+    /*last update into met and the cluster histogram*/
+    met.updates++;
+    if (update == Wolff){
+        met.spins += Ncs;
+        met.cspins += Ncs;
+        met.clusters++;
+        chist[31 - __builtin_clz(Ncs)]++;
+    }
+    else {
+        met.spins += N;
+        if (update == SW){
+            met.clusters += Nc;
+            met.cspins += N;
+        }
+    }
+}
+void metrics_start(){
+    /*first line of the run (or of the resumed part) and the timers, which go on from the checkpoint if resumed*/
+    if (!met_file) return;
+    if (use_perf) perf_setup();
+    fprintf(met_file, "{\"type\": \"run\", \"L\": %d, \"dim\": %d, \"kappa\": %.7f, \"algorithm\": \"%s\", \"layout\": \"%s\", "
+            "\"threads\": %d, \"seed\": %lu, \"nblock\": %d, \"nmeas\": %d, \"ntherm\": %d, \"resumed\": %s, \"counters\": %s}\n",
+            L, dim, kappa, algorithm, layout_names[layout], (update == SW) ? omp_get_max_threads() : 1, seed, nblock, nmeas, ntherm,
+            resume ? "true" : "false", use_perf ? "true" : "false");
+    if (use_perf) perf_read(perf_last);
+    phase_start = wall_time();
+    if (resume) run_start += phase_start;   // -(wall seconds before the checkpoint), from load_checkpoint
+    else {
+        memset(&met, 0, sizeof(met));
+        memset(&met_total, 0, sizeof(met_total));
+        run_start = phase_start;
+    }
+    phase = PH_THERM;
+}
+void metrics_write(const char *type, int block, const metrics_t *mt){
+    /* One JSON line of type (therm, block or final) for the period of mt: the
+     * seconds of every phase, updates, spin updates per second of the period,
+     * mean cluster size, counters of the update and measure phases and the
+     * cluster histogram of the run so far.
+     */
+    static const char *perf_names[NPERF] = {"cycles", "instructions", "cache_references", "cache_misses", "branch_misses"};
+    static const int perf_phases[2] = {PH_UPDATE, PH_MEASURE};
+    double tp = 0;
+    int p, c, b, nh;
+
+    for (p=0; p<NPHASE; p++) tp += mt->t[p];
+    fprintf(met_file, "{\"type\": \"%s\", \"block\": %d, \"wall\": %.6f, \"nupdte\": %d, \"metropolis\": %d, \"seconds\": {",
+            type, block, phase_start - run_start, nupdte, mix);
+    for (p=0; p<NPHASE; p++) fprintf(met_file, "%s\"%s\": %.6f", p ? ", " : "", phase_names[p], mt->t[p]);
+    fprintf(met_file, "}, \"updates\": %lu, \"spin_updates\": %lu, \"flips_per_s\": %.6g, \"mean_cluster\": ",
+            mt->updates, mt->spins, tp > 0 ? mt->spins / tp : 0);
+    if (mt->clusters) fprintf(met_file, "%.3f", (double) mt->cspins / mt->clusters);
+    else fprintf(met_file, "null");
+    if (use_perf){
+        fprintf(met_file, ", \"counters\": {");
+        for (p=0; p<2; p++){
+            fprintf(met_file, "%s\"%s\": {", p ? ", " : "", phase_names[perf_phases[p]]);
+            for (c=0; c<NPERF; c++)
+                fprintf(met_file, "%s\"%s\": %lu", c ? ", " : "", perf_names[c], mt->cnt[perf_phases[p]][c]);
+            fprintf(met_file, "}");
+        }
+        fprintf(met_file, "}");
+    }
+    for (nh=NHIST; nh>0 && !chist[nh-1]; nh--);
+    fprintf(met_file, ", \"cluster_hist_log2\": [");
+    for (b=0; b<nh; b++) fprintf(met_file, "%s%lu", b ? ", " : "", chist[b]);
+    fprintf(met_file, "]}\n");
+}
+void metrics_line(const char *type, int block){
+    /*writes the period since the last line and adds it to the run*/
+    int p, c;
+    if (!met_file) return;
+    phase_to(PH_OUTPUT);
+    metrics_write(type, block, &met);
+    for (p=0; p<NPHASE; p++){
+        met_total.t[p] += met.t[p];
+        for (c=0; c<NPERF; c++) met_total.cnt[p][c] += met.cnt[p][c];
+    }
+    met_total.updates += met.updates;
+    met_total.spins += met.spins;
+    met_total.clusters += met.clusters;
+    met_total.cspins += met.cspins;
+    memset(&met, 0, sizeof(met));
+}
+
+/*--scheduler--*/
+void step(){
+    /*one update of the schedule, followed by a Metropolis sweep if mixed*/
+    update();
+    if (met_file) count_update();
+    if (mix){
+        metropolis();
+        if (met_file) met.spins += N;
+    }
+}
+void autocorr(const double *x, int P, int lmax, double *rho){
+    /*normalized autocorrelation rho[0..lmax] of the P values x*/
+    double mean = 0, var = 0, c;
+    int t, l;
+    for (t=0; t<P; t++) mean += x[t] / P;
+    for (t=0; t<P; t++) var += (x[t] - mean) * (x[t] - mean) / P;
+    for (l=0; l<=lmax; l++){
+        c = 0;
+        for (t=0; t+l<P; t++) c += (x[t] - mean) * (x[t+l] - mean);
+        rho[l] = (var > 0) ? c / ((P-l) * var) : (l == 0);
+    }
+}
+double tau_every(const double *rho, int lmax, int n){
+    /* tau_int in measures of the chain measured every n steps, from the
+     * autocorrelation rho of the one measured after every step, summed up to a
+     * window of 6 tau_int (Sokal). Negative if rho ends before the window does.
+     */
+    double tau = 0.5;
+    int j;
+    for (j=1; j<6*tau; j++){
+        if (j*n > lmax) return -tau;
+        tau += rho[j*n];
+    }
+    return tau;
+}
+void pilot(int P, int stride, int lmax, double *tau, double *cost){
+    /* P*stride steps of the current schedule (1 update, and a sweep if mix)
+     * measured every stride: tau[n] is the tau_int of e and |m| (the largest, <0
+     * if unknown or n isn't a multiple of stride) measuring every n steps for
+     * n=1..nauto, cost[0] the seconds per step and cost[1] per measure (timed
+     * apart by measuring the last state P times).
+     */
+    double *x = (double*) malloc(sizeof(double) * 2*P),
+           *rho = (double*) malloc(sizeof(double) * 2*(lmax+1)), t0, t1, t2, te, tm;
+    stats_t st = {{0}, NULL, 0, 0};
+    int p, n;
+    if (!x || !rho){printf("ERROR: not enough memory for the scheduler\n"); exit(1);}
+
+    t0 = wall_time();
+    for (p=0; p<P; p++){
+        for (n=0; n<stride; n++)
+            step();
+        take_measure();
+        stats_add(&st);
+        x[p] = e;
+        x[P+p] = fabs(m);
+    }
+    t1 = wall_time();
+    for (p=0; p<P; p++){
+        if (update != Wolff || mix) measure();
+        else observables();
+        stats_add(&st);
+    }
+    t2 = wall_time();
+    cost[1] = (t2 - t1) / P;
+    cost[0] = fmax(t1 - t0 - (t2 - t1), 1e-9*P) / ((double) P*stride);
+
+    autocorr(x, P, lmax, rho);
+    autocorr(x + P, P, lmax, rho + lmax+1);
+    for (n=1; n<=nauto; n++){
+        te = (n % stride) ? -1 : tau_every(rho, lmax, n/stride);
+        tm = (n % stride) ? -1 : tau_every(rho + lmax+1, lmax, n/stride);
+        tau[n] = (te < 0 || tm < 0) ? -1 : fmax(te, tm);
+    }
+    free(x);
+    free(rho);
+}
+void patch_nupdte(FILE *out, const char *ext){
+    /*nupdte in the header of output_file.ext (open in out)*/
+    char name[FILENAME_MAX+8];
+    uint32_t nu = nupdte;
+    FILE *f;
+    snprintf(name, sizeof(name), "%s.%s", out_name, ext);
+    fflush(out);
+    if (!(f = fopen(name, "r+b")) || fseek(f, offsetof(out_header, nupdte), SEEK_SET) || fwrite(&nu, sizeof(nu), 1, f) != 1)
+        printf("WARNING: can't write nupdte to the header of %s\n", name);
+    if (f) fclose(f);
+}
+void tune_schedule(){
+    /* Chooses nupdte (and whether every update is followed by a Metropolis sweep
+     * with -M) for the most independent measures per second, 1/(2 tau_int cost),
+     * with the tau_int measured every n steps and the cost t_measure + n*t_step
+     * of a pilot run after the thermalization. The schedules whose tau_int is
+     * longer than the pilot can resolve are skipped. While none is left (as for
+     * Wolff at high temperature, which flips a few spins per update) the pilot
+     * is repeated measuring every 8 times more steps, up to nmax, and then the
+     * longest schedule is taken. The pilot goes on the same chain, as more
+     * thermalization.
+     */
+    int P = nblock*nmeas, lmax, n, f, nbest = nauto, fbest = 0, stride[2], found;
+    double *tau[2], cost[2][2], r, rbest = -1;
+    uint64_t npilot = 0;
+
+    if (P > PILOT) P = PILOT;
+    if (P < 64) P = 64;
+    lmax = P/8;
+    for (f=0; f<=mixable; f++){
+        tau[f] = (double*) malloc(sizeof(double) * (nauto+1));
+        if (!tau[f]){printf("ERROR: not enough memory for the scheduler\n"); exit(1);}
+        mix = f;
+        for (stride[f]=1; ; stride[f]*=8){
+            pilot(P, stride[f], lmax, tau[f], cost[f]);
+            npilot += (uint64_t) P*stride[f];
+            for (found=0, n=1; n<=nauto; n++){
+                if (tau[f][n] < 0) continue;
+                found = 1;
+                r = 1 / (2*tau[f][n] * (cost[f][1] + n*cost[f][0]));
+                if (r > rbest){rbest = r; nbest = n; fbest = f;}
+            }
+            if (found || 8*stride[f] > nauto) break;
+        }
+    }
+    nupdte = nbest;
+    mix = fbest;
+    tuned = 1;
+    ntotal = ntherm + npilot + nblock*nmeas*nupdte;
+
+    for (f=0; f<=mixable; f++){
+        printf("pilot%s: %d measures every %d steps, %.3g us per step and %.3g us per measure, ",
+               f ? " with metropolis sweeps" : "", P, stride[f], 1e6*cost[f][0], 1e6*cost[f][1]);
+        if (tau[f][stride[f]] < 0) printf("tau_int unknown\n");
+        else printf("tau_int %.3g steps\n", stride[f] * (tau[f][stride[f]] - 0.5) + 0.5);
+    }
+    if (rbest < 0)
+        printf("WARNING: tau_int beyond what the pilot resolves, using the longest schedule\n");
+    printf("schedule: %d %s updates%s per measure", nupdte, algorithm, mix ? ", each followed by a metropolis sweep," : "");
+    if (rbest > 0) printf(", tau_int %.3g measures, %.3g independent measures/s", tau[mix][nupdte], rbest);
+    printf("\nEstimated time: %5dmin\n\n", (int) (nblock*nmeas * (cost[mix][1] + nupdte*cost[mix][0]) / 60));
+    fprintf(out_file, "# schedule: nupdte=%d metropolis=%d tau_int=%.4g indep/s=%.4g pilot=%lu\n",
+            nupdte, mix, tau[mix][nupdte], rbest, npilot);
+    for (f=0; f<=mixable; f++) free(tau[f]);
+
+    if (raw && binary) patch_nupdte(raw_file[0], "raw");    // the headers get the chosen nupdte
+    if (hist) patch_nupdte(hist_file, "hist");
+}
+
+/*--checkpoints--*/
+void save_checkpoint(){
+    /* Everything needed to continue the run bit for bit: progress, PRNG state of
+     * every thread, lattice and statistics, with the length of the output files
+     * (flushed) to cut what is written after it. It goes to a temporary file that
+     * is renamed at the end, so a run killed while writing keeps the previous one.
+     * The lattice is 1 bit per spin, so it takes a few ms even for L=4096.
+     */
+    char name[FILENAME_MAX+8], tmp[FILENAME_MAX+12];
+    int nthr = omp_get_max_threads(), ok;
+    ckpt_stream *cs = (ckpt_stream*) malloc(sizeof(ckpt_stream) * nthr);
+    ckpt_header h;
+
+    if (!cs){printf("WARNING: not enough memory, no checkpoint\n"); return;}
+    #pragma omp parallel num_threads(nthr)
+    {
+    ckpt_stream *c = cs + omp_get_thread_num();
+    c->g = rng;
+    memcpy(c->buf, rnd_buf, sizeof(rnd_buf));
+    c->pos = rnd_pos;
+    memcpy(c->bond_buf, bond_buf, sizeof(bond_buf));
+    c->bond_pos = bond_pos;
+    c->bond_bits = bond_bits;
+    }
+
+    fflush(out_file);
+    fsync(fileno(out_file));
+    if (raw){
+        fflush(raw_file[0]);
+        fsync(fileno(raw_file[0]));
+    }
+    if (hist){
+        fflush(hist_file);
+        fsync(fileno(hist_file));
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CKPT_MAGIC, sizeof(h.magic));
+    h.version = CKPT_VERSION;
+    h.L = L; h.nblock = nblock; h.nmeas = nmeas; h.nupdte = nupdte; h.ntherm = ntherm;
+    h.kappa = kappa;
+    memcpy(h.algorithm, algorithm, sizeof(h.algorithm));
+    h.raw = raw; h.binary = binary; h.prng = prng_kind; h.bond = bond_force; h.layout = layout; h.dim = dim;
+    h.mix = mix; h.mixable = mixable; h.nauto = nauto; h.hist = hist; h.metrics = (met_file != NULL);
+    h.nthreads = nthr;
+    h.seed = seed;
+    h.nt = nt; h.nb = nb; h.nm = nm;
+    h.nmeasured = nmeasured;
+    h.E = E; h.M = M;
+    h.st_n = stats[0].n; h.st_nb = stats[0].nb;
+    h.out_pos = ftell(out_file);
+    h.raw_pos = raw ? ftell(raw_file[0]) : 0;
+    h.hist_pos = hist ? ftell(hist_file) : 0;
+    if (met_file){
+        fflush(met_file);
+        fsync(fileno(met_file));
+        h.met_pos = ftell(met_file);
+        h.met_wall = phase_start - run_start;       // phase_to(PH_CKPT) just closed the last phase
+    }
+
+    snprintf(name, sizeof(name), "%s.ckpt", out_name);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+    bk_file = fopen(tmp, "wb");
+    if (!bk_file){printf("WARNING: can't open %s, no checkpoint\n", tmp); free(cs); return;}
+    ok = fwrite(&h, sizeof(h), 1, bk_file) == 1 &&
+         fwrite(cs, sizeof(ckpt_stream), nthr, bk_file) == (size_t) nthr &&
+         fwrite(lat, sizeof(uint64_t), NW, bk_file) == NW &&
+         fwrite(stats[0].sum, sizeof(double), NOBS, bk_file) == NOBS &&
+         fwrite(stats[0].blk, sizeof(double), NOBS*stats[0].nb, bk_file) == NOBS*stats[0].nb &&
+         (!hist || fwrite(hbuf, sizeof(out_record), stats[0].n, bk_file) == stats[0].n) &&
+         (!met_file || (fwrite(&met, sizeof(met), 1, bk_file) == 1 && fwrite(&met_total, sizeof(met_total), 1, bk_file) == 1 &&
+                        fwrite(chist, sizeof(chist), 1, bk_file) == 1));
+    ok = !fflush(bk_file) && !fsync(fileno(bk_file)) && ok;
+    fclose(bk_file);
+    if (!ok || rename(tmp, name)){printf("WARNING: can't write %s, previous checkpoint kept\n", name); remove(tmp);}
+    free(cs);
+    ckpt_last = time(0);
+}
+void checkpoint(){
+    /*saves the run if it's time to*/
+    if (ckpt_every >= 0 && time(0) - ckpt_last >= ckpt_every){
+        int p = phase;
+        phase_to(PH_CKPT);
+        save_checkpoint();
+        phase_to(p);
+    }
+}
+FILE *reopen_output(const char *name, int64_t pos){
+    /*output file cut to pos to append after the checkpoint*/
+    FILE *f;
+    if (truncate(name, pos) || !(f = fopen(name, "a"))){printf("ERROR: can't reopen %s\n", name); exit(1);}
+    setvbuf(f, NULL, _IOFBF, OUT_BUFFER);
+    return f;
+}
+void load_checkpoint(){
+    /*state of the run from output_file.ckpt, after checking it is the same run*/
+    char name[FILENAME_MAX+8];
+    ckpt_header h;
+
+    snprintf(name, sizeof(name), "%s.ckpt", out_name);
+    bk_file = fopen(name, "rb");
+    if (!bk_file){printf("ERROR: can't open %s\n", name); exit(1);}
+    if (fread(&h, sizeof(h), 1, bk_file) != 1 || memcmp(h.magic, CKPT_MAGIC, sizeof(h.magic)) || h.version != CKPT_VERSION){
+        printf("ERROR: %s is not a checkpoint\n", name); exit(1);
+    }
+    if (h.L != (uint32_t) L || h.nblock != nblock || h.nmeas != nmeas || (nauto ? h.nauto != nauto : h.nupdte != nupdte) || h.ntherm != ntherm ||
+        h.kappa != kappa || strncmp(h.algorithm, algorithm, sizeof(h.algorithm)) || h.raw != raw || h.binary != binary || h.prng != prng_kind || h.bond != bond_force ||
+        h.layout != layout || h.dim != dim || h.mixable != mixable || h.hist != hist || h.metrics != (met_file != NULL)){
+        printf("ERROR: %s is from a run with other arguments or options\n", name); exit(1);
+    }
+    if (update == SW && h.nthreads != (uint32_t) omp_get_max_threads()){
+        printf("ERROR: %s is from a run with %u threads\n", name, h.nthreads); exit(1);
+    }
+
+    ckpt_stream *cs = (ckpt_stream*) malloc(sizeof(ckpt_stream) * h.nthreads);
+    if (!cs){printf("ERROR: not enough memory for %s\n", name); exit(1);}
+    if (fread(cs, sizeof(ckpt_stream), h.nthreads, bk_file) != h.nthreads ||
+        fread(lat, sizeof(uint64_t), NW, bk_file) != NW ||
+        fread(stats[0].sum, sizeof(double), NOBS, bk_file) != NOBS ||
+        fread(stats[0].blk, sizeof(double), NOBS*h.st_nb, bk_file) != NOBS*h.st_nb ||
+        (hist && fread(hbuf, sizeof(out_record), h.st_n, bk_file) != h.st_n) ||
+        (met_file && (fread(&met, sizeof(met), 1, bk_file) != 1 || fread(&met_total, sizeof(met_total), 1, bk_file) != 1 ||
+                      fread(chist, sizeof(chist), 1, bk_file) != 1))){
+        printf("ERROR: %s is truncated\n", name); exit(1);
+    }
+    fclose(bk_file);
+
+    #pragma omp parallel
+    if ((uint32_t) omp_get_thread_num() < h.nthreads){
+        ckpt_stream *c = cs + omp_get_thread_num();
+        rng = c->g;
+        memcpy(rnd_buf, c->buf, sizeof(rnd_buf));
+        rnd_pos = c->pos;
+        memcpy(bond_buf, c->bond_buf, sizeof(bond_buf));
+        bond_pos = c->bond_pos;
+        bond_bits = c->bond_bits;
+        bond_lg = (bond_bits == 16) ? 2 : (bond_bits == 32) ? 1 : 0;
+    }
+    free(cs);
+    seed = h.seed;
+    nt = h.nt; nb = h.nb; nm = h.nm;
+    nmeasured = h.nmeasured;
+    E = h.E; M = h.M;
+    stats[0].n = h.st_n; stats[0].nb = h.st_nb;
+    run_start = -h.met_wall;            // made relative to the resumed start by metrics_start
+    if (nauto && nt == ntherm){         // measuring, with the schedule chosen before the checkpoint
+        nupdte = h.nupdte;
+        mix = h.mix;
+        tuned = 1;
+    }
+    printf("resuming from %s: %u thermalization updates, %u blocks and %u measures done\n", name, nt, nb, nm);
+
+    out_file = reopen_output(out_name, h.out_pos);
+    if (raw){
+        snprintf(name, sizeof(name), "%s.raw", out_name);
+        raw_file[0] = reopen_output(name, h.raw_pos);
+    }
+    if (hist){
+        snprintf(name, sizeof(name), "%s.hist", out_name);
+        hist_file = reopen_output(name, h.hist_pos);
+    }
+    if (met_file){                      // the lines after the checkpoint are written again
+        fclose(met_file);
+        met_file = reopen_output(met_name, h.met_pos);
+    }
 }
 
 /*----MAIN PROGRAM----*/
 /*-----------------*/
 int main(int argc, char *argv[]){
     get_data(argc, argv);       // Getting input data
+    if (njob){
+        run_batch();
+        return 0;
+    }
+    if (nbench){
+        run_bench();
+        return 0;
+    }
     setup();                    // Setting up and generating the lattice
 
     uint8_t nbdisp = nblock/NBLCKDISP;
     if (nbdisp == 0) nbdisp = 1;        // nblock < NBLCKDISP, so display them all
 
     disp_init_info();               // disp some initial info
+    if (nkappa){
+        run_pt();
+        return 0;
+    }
+    if (nchain){
+        run_ensemble();
+        return 0;
+    }
 
     /*Thermalization*/
     printf("Beginning thermalization\n");
-    clock_t begin_timer = clock();
-    for (int nt=0; nt<ntherm; nt++) {
-        Wolff();
+    ckpt_last = time(0);
+    uint16_t nt0 = nt;          // not 0 if resumed
+    metrics_start();
+    double time_spent = wall_time();        // wall time, also right with threads
+    for (; nt<ntherm; nt++) {
+        checkpoint();
+        step();
     }
-    clock_t end_timer = clock();
+    time_spent = wall_time() - time_spent;
     //disp_lattice(lat);
     printf("Thermalization finished!\n\n");
 
     /*Measurements*/
     printf("Beginning measures\n");
-    float time_spent = (float) (end_timer-begin_timer)/CLOCKS_PER_SEC;
-    printf("Estimated time: %5dmin\n", (int) (time_spent/ntherm * (ntotal-ntherm)/60));
-    for (int nb=0; nb<nblock; nb++) {
+    if (nauto && !tuned){
+        phase_to(PH_PILOT);
+        tune_schedule();
+    }
+    else if (nt0 < ntherm)
+        printf("Estimated time: %5dmin\n", (int) (time_spent/(ntherm-nt0) * (ntotal-ntherm)/60));
+    metrics_line("therm", 0);
+    double d[NDER];             // observables of the last block
+    for (; nb<nblock; nb++) {
+        for (; nm<nmeas; nm++){
+            checkpoint();
+            phase_to(PH_UPDATE);
+            for (k=0; k<nupdte; k++)
+                step();
+            phase_to(PH_MEASURE);
+            take_measure();
+            if (hist) hbuf[stats[0].n] = (out_record) {E, M};     // before stats_add counts it
+            stats_add(&stats[0]);
+            if (raw){
+                phase_to(PH_OUTPUT);
+                write_measure(raw_file[0]);
+            }
+        }
+        nm = 0;
+        phase_to(PH_OUTPUT);
+        if (hist) hist_block_write(nb+1, stats[0].n);
+        stats_block(&stats[0], out_file, kappa, d);
         if (nb%nbdisp == 0 || nb == nblock-1){
-            measure();
-            printf("%3.0f%%:\te=%4.3f\tm^2=%4.3f\n", (float) 1.25*nb/nblock*100, e, m*m);
+            printf("%3.0f%%:\te=%4.3f\t|m|=%4.3f\tU=%4.3f\n", (float) (nb+1)/nblock*100, d[0], d[1], d[6]);
             //disp_lattice(lat);
         }
-        for (j=0; j<nmeas; j++){
-            for (k=0; k<nupdte; k++)
-                Wolff();
-            measure();
-            fprintf(out_file, "\n%6.4f\t%6.4f", e, m);
-        }
+        metrics_line("block", nb+1);
+    }
+    printf("Measures finished!\n\n");
+    stats_final(&stats[0], out_file, kappa);
+    stats_final(&stats[0], stdout, kappa);
+    fclose(out_file);
+    if (raw) fclose(raw_file[0]);
+    if (hist) fclose(hist_file);
+    if (met_file){
+        phase_to(PH_OUTPUT);
+        metrics_write("final", nblock, &met_total);
+        fclose(met_file);
     }
-    printf("Measures finished!\n");
     return 0;
 }
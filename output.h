@@ -0,0 +1,47 @@
+/*Binary measurement files written by main.c and read by read_output.c:
+  a fixed header followed by one record per measure. Histogram files
+  (-H, read by reweight.c) have the same header with HIST_MAGIC, and
+  every block is a hist_block followed by its entries*/
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include<stdint.h>
+
+#define OUT_MAGIC   "ISINGMC"   // first 8 bytes of every binary file (with the final \0)
+#define OUT_VERSION 3           // layout of the header and records, readers accept only this one
+#define HIST_MAGIC  "ISINGHS"   // first 8 bytes of every histogram file
+#define OUT_BUFFER  (1<<22)     // bytes of the stdio buffer of every output file
+
+typedef struct {
+    char     magic[8];          // OUT_MAGIC
+    uint32_t version,           // OUT_VERSION
+             L;                 // length of the lattice, N=L^dim
+    double   kappa;             // J/kT of the measures
+    uint64_t seed;              // seed of the PRNG streams
+    uint32_t nblock,            // number of blocks
+             nmeas,             // measures per block
+             nupdte,            // updates between 2 measures
+             ntherm;            // thermalization updates
+    char     algorithm[12];     // wolff, sw or metropolis
+    uint32_t record_size;       // bytes per record, sizeof(out_record)
+    char     prng[8];           // xoshiro or philox
+    uint32_t dim;               // dimension of the lattice
+} out_header;                   // 80 bytes with padding
+
+typedef struct {
+    int64_t  E,                 // sum of s_i*s_j over bonds, e=-E/N
+             M;                 // sum of s_i, m=M/N
+} out_record;
+
+typedef struct {
+    uint32_t block,             // number of the block, from 1
+             n;                 // entries that follow
+} hist_block;
+
+typedef struct {
+    int64_t  E, M;              // as in out_record
+    uint64_t count;             // measures of the block with this E and M
+} hist_entry;                   // sorted by E and then M within a block
+
+#endif
@@ -0,0 +1,155 @@
+/*Pseudo random number generators with independent streams for main.c
+  and the samples:
+   - xoshiro256**: streams are 2^128 numbers apart with jump(), groups of
+     streams 2^192 apart with long_jump()
+   - Philox4x32-10: counter based, the seed is the key and the stream is
+     the high half of the 128-bit counter
+  Both fill buffers in bulk with 64-bit randoms, or with 32-bit ones to
+  compare against 32-bit thresholds*/
+
+#ifndef PRNG_H
+#define PRNG_H
+
+#include<stdint.h>
+#include<stddef.h>
+
+#define PRNG_XOSHIRO 0
+#define PRNG_PHILOX  1
+
+typedef struct {
+    uint8_t  kind;      // PRNG_XOSHIRO or PRNG_PHILOX
+    uint64_t s[4];      // xoshiro256** state, or Philox key (s[0]) and counter (s[1] low, s[2] high)
+} prng_t;
+
+static inline uint64_t prng_splitmix64(uint64_t *x){    // seeds the states
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+static inline uint64_t prng_rotl(uint64_t x, int k){
+    return (x << k) | (x >> (64 - k));
+}
+
+/*--xoshiro256**--*/
+static inline uint64_t xoshiro256_next(uint64_t *s){
+    uint64_t r = prng_rotl(s[1] * 5, 7) * 9,
+             t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = prng_rotl(s[3], 45);
+    return r;
+}
+static inline void xoshiro256_advance(uint64_t *s, const uint64_t *poly){
+    /*jumps ahead by the polynomial of jump() or long_jump()*/
+    uint64_t t[4] = {0, 0, 0, 0};
+    for (int w=0; w<4; w++)
+        for (int b=0; b<64; b++){
+            if (poly[w] & (1ULL << b)){
+                t[0] ^= s[0]; t[1] ^= s[1]; t[2] ^= s[2]; t[3] ^= s[3];
+            }
+            xoshiro256_next(s);
+        }
+    s[0] = t[0]; s[1] = t[1]; s[2] = t[2]; s[3] = t[3];
+}
+static inline void xoshiro256_jump(uint64_t *s){        // 2^128 numbers ahead
+    static const uint64_t poly[4] = {0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+                                     0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL};
+    xoshiro256_advance(s, poly);
+}
+static inline void xoshiro256_long_jump(uint64_t *s){   // 2^192 numbers ahead
+    static const uint64_t poly[4] = {0x76e15d3efefdcbbfULL, 0xc5004e441c522fb3ULL,
+                                     0x77710069854ee241ULL, 0x39109bb02acbe635ULL};
+    xoshiro256_advance(s, poly);
+}
+
+/*--Philox4x32-10--*/
+static inline void philox4x32(uint32_t *c, uint32_t k0, uint32_t k1){
+    /*10 rounds on the counter c, which becomes 128 random bits*/
+    uint64_t p0, p1;
+    for (int r=0; r<10; r++){
+        p0 = (uint64_t) 0xD2511F53 * c[0];
+        p1 = (uint64_t) 0xCD9E8D57 * c[2];
+        c[0] = (uint32_t) (p1 >> 32) ^ c[1] ^ k0;
+        c[1] = (uint32_t) p1;
+        c[2] = (uint32_t) (p0 >> 32) ^ c[3] ^ k1;
+        c[3] = (uint32_t) p0;
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+}
+static inline void philox_next(uint64_t *s, uint64_t *r){
+    /*next 2 randoms of the stream, the counter goes up by one*/
+    uint32_t c[4] = {(uint32_t) s[1], (uint32_t) (s[1] >> 32), (uint32_t) s[2], (uint32_t) (s[2] >> 32)};
+    philox4x32(c, (uint32_t) s[0], (uint32_t) (s[0] >> 32));
+    r[0] = c[0] | (uint64_t) c[1] << 32;
+    r[1] = c[2] | (uint64_t) c[3] << 32;
+    if (!++s[1]) s[2]++;
+}
+
+/*--common interface--*/
+static inline void prng_seed(prng_t *g, uint8_t kind, uint64_t seed, uint32_t stream){
+    /*stream number stream of the generator kind for seed*/
+    uint64_t x = seed;
+    g->kind = kind;
+    if (kind == PRNG_PHILOX){
+        g->s[0] = seed;
+        g->s[1] = 0;
+        g->s[2] = (uint64_t) stream << 32;  // 2^96 blocks per stream
+        g->s[3] = 0;
+        return;
+    }
+    for (int w=0; w<4; w++)
+        g->s[w] = prng_splitmix64(&x);
+    for (uint32_t j=0; j<stream; j++)
+        xoshiro256_jump(g->s);
+}
+static inline void prng_long_jump(prng_t *g){
+    /*to a new group of streams, for independent sets of threads*/
+    if (g->kind == PRNG_PHILOX) g->s[2] += 1ULL << 63;
+    else xoshiro256_long_jump(g->s);
+}
+static inline void prng_fill(prng_t *g, uint64_t *buf, size_t n){
+    /*n 64-bit randoms*/
+    size_t j;
+    uint64_t r[2];
+    if (g->kind == PRNG_PHILOX){
+        for (j=0; j+1<n; j+=2)
+            philox_next(g->s, buf + j);
+        if (j < n){
+            philox_next(g->s, r);
+            buf[j] = r[0];
+        }
+    }
+    else
+        for (j=0; j<n; j++)
+            buf[j] = xoshiro256_next(g->s);
+}
+static inline void prng_fill32(prng_t *g, uint32_t *buf, size_t n){
+    /*n 32-bit randoms, both halves of every 64-bit one*/
+    uint64_t r[2];
+    size_t j;
+    for (j=0; j+3<n; j+=4){
+        prng_fill(g, r, 2);
+        buf[j]   = (uint32_t) r[0]; buf[j+1] = (uint32_t) (r[0] >> 32);
+        buf[j+2] = (uint32_t) r[1]; buf[j+3] = (uint32_t) (r[1] >> 32);
+    }
+    if (j < n){
+        prng_fill(g, r, 2);
+        for (int h=0; j<n; j++, h++)
+            buf[j] = (uint32_t) (r[h>>1] >> (32*(h&1)));
+    }
+}
+static inline uint64_t prng_threshold(double p){
+    /*r < prng_threshold(p) with a 64-bit random r happens with probability p*/
+    return (p >= 1) ? UINT64_MAX : (p <= 0) ? 0 : (uint64_t) (p * 0x1p+64);
+}
+static inline uint32_t prng_threshold32(double p){
+    /*same for a 32-bit random, p is rounded down to a multiple of 2^-32*/
+    return (p >= 1) ? UINT32_MAX : (p <= 0) ? 0 : (uint32_t) (p * 0x1p+32);
+}
+
+#endif
@@ -0,0 +1,66 @@
+/*Reader of the binary measurement files of main.c (see output.h):
+  prints the header and streams the records as e,m text lines
+  without loading the file in memory*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<string.h>
+#include<math.h>
+#include "output.h"
+
+#define NREC 65536          // records read at a time
+
+int main(int argc, char *argv[]){
+    FILE *in_file, *out_file = stdout;
+    out_header h;
+    out_record *rec;
+    uint64_t nrec = 0;      // records read
+    size_t nread, r;
+    double invN;
+
+    if (argc < 2 || argc > 3){
+        printf("Usage:\t %s binary_file [OPTIONAL] text_file\n", argv[0]);
+        printf("default: text to stdout, header always to stderr\n");
+        exit(1);
+    }
+    in_file = fopen(argv[1], "rb");
+    if (!in_file){fprintf(stderr, "ERROR: can't open %s\n", argv[1]); exit(1);}
+    if (argc == 3){
+        out_file = fopen(argv[2], "w");
+        if (!out_file){fprintf(stderr, "ERROR: can't open %s\n", argv[2]); exit(1);}
+    }
+
+    if (fread(&h, sizeof(h), 1, in_file) != 1 || memcmp(h.magic, OUT_MAGIC, sizeof(h.magic))){
+        fprintf(stderr, "ERROR: %s is not a binary output file\n", argv[1]); exit(1);
+    }
+    if (h.version != OUT_VERSION || h.record_size != sizeof(out_record)){
+        fprintf(stderr, "ERROR: %s has version %u with %u bytes per record, expected version %d with %zu\n",
+                argv[1], h.version, h.record_size, OUT_VERSION, sizeof(out_record));
+        exit(1);
+    }
+    h.algorithm[sizeof(h.algorithm)-1] = '\0';
+    h.prng[sizeof(h.prng)-1] = '\0';
+    fprintf(stderr, "L: %u\ndim: %u\nkappa: %.7f\nseed: %lu (%s)\nalgorithm: %s\n", h.L, h.dim, h.kappa, h.seed, h.prng, h.algorithm);
+    fprintf(stderr, "nblock: %u\nnmeas: %u\nnupdte: %u\nntherm: %u\n", h.nblock, h.nmeas, h.nupdte, h.ntherm);
+
+    rec = (out_record*) malloc(sizeof(out_record) * NREC);
+    if (!rec){fprintf(stderr, "ERROR: not enough memory\n"); exit(1);}
+    setvbuf(out_file, NULL, _IOFBF, OUT_BUFFER);
+    invN = pow(h.L, -(double) h.dim);
+
+    while ((nread = fread(rec, sizeof(out_record), NREC, in_file)) > 0){
+        for (r=0; r<nread; r++)     // same layout as the text output of main.c, full precision
+            fprintf(out_file, "\n%.12f\t%.12f", -invN * rec[r].E, invN * rec[r].M);
+        nrec += nread;
+    }
+
+    fprintf(stderr, "records: %lu", nrec);
+    if (nrec != (uint64_t) h.nblock * h.nmeas) fprintf(stderr, " (expected %lu, incomplete run)", (uint64_t) h.nblock * h.nmeas);
+    fprintf(stderr, "\n");
+
+    free(rec);
+    fclose(in_file);
+    fclose(out_file);
+    return 0;
+}
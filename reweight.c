@@ -0,0 +1,242 @@
+/*Multiple histogram reweighting (Ferrenberg-Swendsen) of the histogram
+  files of main.c -H (see output.h): the runs at several kappas of the
+  same lattice are combined into the density of states, which gives the
+  observables of main.c at any kappa near them, with jackknife errors
+  (leaving out one block of every run at a time)*/
+
+#include<stdio.h>
+#include<stdlib.h>
+#include<stdint.h>
+#include<string.h>
+#include<stddef.h>
+#include<math.h>
+#include "output.h"
+
+#define MAXRUNS 64          // max number of histogram files
+#define MAXITER 100000      // max iterations of the free energies
+#define FTOL 1e-10          // change of the free energies to stop
+#define NDER 7              // reported observables: e, |m|, m^2, m^4, C, chi, U
+
+typedef struct {
+    int64_t  E;
+    int      run, block;
+    double   s[4];          // measures, sum of |M|, M^2 and M^4
+} entry_t;
+
+int      nrun, nbin, nE;    // runs, jackknife bins and distinct energies
+double   kap[MAXRUNS],      // kappa of every run
+        *Ev,                // distinct energies, increasing
+        *sum,               // sums per bin, energy and s (nbin*nE*4)
+        *nr,                // measures per run and bin (nrun*nbin)
+         N;                 // sites
+
+int compare_entries(const void *a, const void *b){
+    const entry_t *p = (const entry_t *) a, *q = (const entry_t *) b;
+    return (p->E > q->E) - (p->E < q->E);
+}
+double lse(double a, double b){
+    /*log(exp(a)+exp(b))*/
+    if (a < b){double t = a; a = b; b = t;}
+    return (b == -INFINITY) ? a : a + log1p(exp(b - a));
+}
+void sample(int out, double *h, double *n){
+    /*sums per energy h (nE*4) and measures per run n without bin out (-1: all bins)*/
+    int b, q, r;
+    memset(h, 0, sizeof(double) * nE*4);
+    memset(n, 0, sizeof(double) * nrun);
+    for (b=0; b<nbin; b++){
+        if (b == out) continue;
+        for (q=0; q<nE*4; q++) h[q] += sum[(size_t) b*nE*4 + q];
+        for (r=0; r<nrun; r++) n[r] += nr[r*nbin + b];
+    }
+}
+int free_energies(const double *h, const double *n, double *f, double *lD){
+    /* Self-consistent f_r = log sum_E H(E) exp(k_r E) / D(E), with
+     * D(E) = sum_s n_s exp(k_s E - f_s) (logs in lD) and f_0 = 0, starting from
+     * the f given. Returns the iterations, or -1 if it didn't converge.
+     */
+    int it, r, q;
+    double fn, d;
+    for (it=1; it<=MAXITER; it++){
+        for (q=0; q<nE; q++){
+            lD[q] = -INFINITY;
+            for (r=0; r<nrun; r++)
+                if (n[r] > 0) lD[q] = lse(lD[q], log(n[r]) + kap[r]*Ev[q] - f[r]);
+        }
+        d = 0;
+        for (r=nrun-1; r>=0; r--){
+            fn = -INFINITY;
+            for (q=0; q<nE; q++)
+                if (h[4*q] > 0) fn = lse(fn, log(h[4*q]) + kap[r]*Ev[q] - lD[q]);
+            if (r == 0){                // shift so that f_0 = 0
+                for (q=1; q<nrun; q++) f[q] -= fn;
+                fn = 0;
+            }
+            d = fmax(d, fabs(fn - f[r]));
+            f[r] = fn;
+        }
+        if (d < FTOL) return it;
+    }
+    return -1;
+}
+void observables(const double *h, const double *lD, double kp, double *d){
+    /*observables d at kp from the sums h and the log densities lD*/
+    double a, amax = -INFINITY, Z = 0, mE = 0, vE = 0, am = 0, m2 = 0, m4 = 0, w;
+    int q;
+    for (q=0; q<nE; q++)
+        if (h[4*q] > 0) amax = fmax(amax, kp*Ev[q] - lD[q]);
+    for (q=0; q<nE; q++){
+        if (h[4*q] == 0) continue;
+        a = exp(kp*Ev[q] - lD[q] - amax);
+        Z  += a * h[4*q];
+        mE += a * h[4*q] * Ev[q];
+        am += a * h[4*q+1];
+        m2 += a * h[4*q+2];
+        m4 += a * h[4*q+3];
+    }
+    mE /= Z;
+    for (q=0; q<nE; q++)
+        if (h[4*q] > 0){
+            w = exp(kp*Ev[q] - lD[q] - amax) * h[4*q] / Z;
+            vE += w * (Ev[q] - mE) * (Ev[q] - mE);
+        }
+    am /= Z * N;
+    m2 /= Z * N*N;
+    m4 /= Z * N*N*N*N;
+    d[0] = -mE / N;                 // as derived() of main.c
+    d[1] = am;
+    d[2] = m2;
+    d[3] = m4;
+    d[4] = kp*kp * vE / N;
+    d[5] = kp * N * (m2 - am*am);
+    d[6] = 1 - m4 / (3*m2*m2);
+}
+
+int main(int argc, char *argv[]){
+    static const char *name[NDER] = {"e", "|m|", "m^2", "m^4", "C", "chi", "U"};
+    FILE *in_file;
+    out_header h, h0;
+    hist_block hb;
+    hist_entry he;
+    entry_t *ent = NULL;
+    size_t nent = 0, cap = 0, t;
+    int nblk[MAXRUNS], r, b, q, o, k, nk, j, it;
+    uint64_t nmeas[MAXRUNS];
+    double kmin, kmax, kp, kr0 = INFINITY, kr1 = -INFINITY, *hs, *n, *f, *fj, *lD, d[NDER], (*dj)[NDER], mj, err;
+    size_t S;
+
+    memset(&h0, 0, sizeof(h0));
+    if (argc < 5 || sscanf(argv[1], "%lf", &kmin) != 1 || sscanf(argv[2], "%lf", &kmax) != 1 || sscanf(argv[3], "%d", &nk) != 1 || nk < 1){
+        printf("Usage:\t %s kappa_min kappa_max nkappa file1.hist [file2.hist ...]\n", argv[0]);
+        printf("observables of main.c at nkappa kappas from kappa_min to kappa_max with jackknife\n");
+        printf("errors from the histograms of main.c -H runs of the same lattice, to stdout\n");
+        exit(1);
+    }
+    nrun = argc - 4;
+    if (nrun > MAXRUNS){printf("ERROR: up to %d histogram files\n", MAXRUNS); exit(1);}
+
+    /*--histograms--*/
+    for (r=0; r<nrun; r++){
+        in_file = fopen(argv[4+r], "rb");
+        if (!in_file){printf("ERROR: can't open %s\n", argv[4+r]); exit(1);}
+        if (fread(&h, sizeof(h), 1, in_file) != 1 || memcmp(h.magic, HIST_MAGIC, sizeof(h.magic)) ||
+            h.version != OUT_VERSION || h.record_size != sizeof(hist_entry)){
+            printf("ERROR: %s is not a histogram file of version %d\n", argv[4+r], OUT_VERSION); exit(1);
+        }
+        if (r == 0) h0 = h;
+        else if (h.L != h0.L || h.dim != h0.dim){
+            printf("ERROR: %s is from a %u^%u lattice, %s from %u^%u\n", argv[4+r], h.L, h.dim, argv[4], h0.L, h0.dim); exit(1);
+        }
+        kap[r] = h.kappa;
+        kr0 = fmin(kr0, kap[r]);
+        kr1 = fmax(kr1, kap[r]);
+        nblk[r] = 0;
+        nmeas[r] = 0;
+        while (fread(&hb, sizeof(hb), 1, in_file) == 1){
+            for (t=0; t<hb.n; t++){
+                if (fread(&he, sizeof(he), 1, in_file) != 1){printf("ERROR: %s is truncated\n", argv[4+r]); exit(1);}
+                if (nent == cap){
+                    cap = cap ? 2*cap : 65536;
+                    ent = (entry_t*) realloc(ent, sizeof(entry_t) * cap);
+                    if (!ent){printf("ERROR: not enough memory\n"); exit(1);}
+                }
+                double am = llabs(he.M), m2 = am*am;
+                ent[nent].E = he.E;
+                ent[nent].run = r;
+                ent[nent].block = nblk[r];
+                ent[nent].s[0] = he.count;
+                ent[nent].s[1] = he.count * am;
+                ent[nent].s[2] = he.count * m2;
+                ent[nent].s[3] = he.count * m2*m2;
+                nmeas[r] += he.count;
+                nent++;
+            }
+            nblk[r]++;
+        }
+        fclose(in_file);
+        if (nblk[r] < 2){printf("ERROR: %s has %d blocks, jackknife needs 2\n", argv[4+r], nblk[r]); exit(1);}
+    }
+    N = pow(h0.L, h0.dim);
+
+    /*--sums per jackknife bin and energy--*/
+    nbin = nblk[0];                         // block b of every run goes to bin b%nbin
+    for (r=1; r<nrun; r++) if (nblk[r] < nbin) nbin = nblk[r];
+    qsort(ent, nent, sizeof(entry_t), compare_entries);
+    Ev = (double*) malloc(sizeof(double) * nent);
+    for (t=0, nE=0; t<nent; t++)
+        if (!nE || ent[t].E != (int64_t) Ev[nE-1]) Ev[nE++] = ent[t].E;
+    sum = (double*) calloc((size_t) nbin*nE*4, sizeof(double));
+    nr = (double*) calloc(nrun*nbin, sizeof(double));
+    S = nbin + 1;                           // samples: all the measures, then without every bin
+    hs = (double*) malloc(sizeof(double) * S*nE*4);
+    lD = (double*) malloc(sizeof(double) * S*nE);
+    n = (double*) malloc(sizeof(double) * nrun);
+    f = (double*) calloc(nrun, sizeof(double));
+    fj = (double*) malloc(sizeof(double) * nrun);
+    dj = (double(*)[NDER]) malloc(sizeof(double) * NDER * nbin);
+    if (!Ev || !sum || !nr || !hs || !lD || !n || !f || !fj || !dj){printf("ERROR: not enough memory\n"); exit(1);}
+    for (t=0, q=-1; t<nent; t++){
+        if (q < 0 || ent[t].E != (int64_t) Ev[q]) q++;
+        r = ent[t].run;
+        b = ent[t].block % nbin;
+        for (o=0; o<4; o++) sum[((size_t) b*nE + q)*4 + o] += ent[t].s[o];
+        nr[r*nbin + b] += ent[t].s[0];
+    }
+    free(ent);
+
+    /*--free energies of all the measures, then of every jackknife sample starting from them--*/
+    sample(-1, hs, n);
+    it = free_energies(hs, n, f, lD);
+    if (it < 0) printf("WARNING: the free energies didn't converge in %d iterations, too little overlap?\n", MAXITER);
+    for (j=0; j<nbin; j++){
+        memcpy(fj, f, sizeof(double) * nrun);
+        sample(j, hs + (j+1)*nE*4, n);
+        if (free_energies(hs + (j+1)*nE*4, n, fj, lD + (j+1)*nE) < 0) printf("WARNING: jackknife sample %d didn't converge\n", j);
+    }
+    printf("# %u^%u lattice, %d runs, %d jackknife bins, %d energies, %d iterations\n", h0.L, h0.dim, nrun, nbin, nE, it);
+    printf("# run\tkappa\tmeasures\tblocks\tf\n");
+    for (r=0; r<nrun; r++)
+        printf("# %s\t%.7f\t%lu\t%d\t%.10g\n", argv[4+r], kap[r], nmeas[r], nblk[r], f[r]);
+    if (kmin < kr0 || kmax > kr1)
+        printf("# kappas outside [%.7f, %.7f] are extrapolations, reliable within ~1/sqrt(C*N)/kappa of them\n", kr0, kr1);
+    printf("# kappa");
+    for (o=0; o<NDER; o++) printf("\t%s\terror", name[o]);
+    printf("\n");
+
+    for (k=0; k<nk; k++){
+        kp = (nk == 1) ? kmin : kmin + (kmax - kmin) * k / (nk - 1);
+        observables(hs, lD, kp, d);
+        for (j=0; j<nbin; j++)
+            observables(hs + (j+1)*nE*4, lD + (j+1)*nE, kp, dj[j]);
+        printf("%.7f", kp);
+        for (o=0; o<NDER; o++){
+            for (mj=0, j=0; j<nbin; j++) mj += dj[j][o] / nbin;
+            for (err=0, j=0; j<nbin; j++) err += (dj[j][o] - mj) * (dj[j][o] - mj);
+            printf("\t%.10g\t%.3g", d[o], sqrt(err * (nbin-1) / nbin));
+        }
+        printf("\n");
+    }
+
+    free(Ev); free(sum); free(nr); free(hs); free(lD); free(n); free(f); free(fj); free(dj);
+    return 0;
+}
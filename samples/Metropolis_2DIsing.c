@@ -1,24 +1,41 @@
 /*Energy and magnetization for 2D periodical
-  lattices using Metropolis method and Ising model*/
+  lattices using Metropolis method and Ising model
+  (compile with -mavx2 for the SIMD checkerboard kernel
+   and with -fopenmp to split it in row strips among threads)*/
 
 #include<stdio.h>
 #include<stdlib.h>
+#include<stdint.h>
+#include<unistd.h>
 #include<math.h>
 #include<time.h>
+#include "../prng.h"
+#ifdef __AVX2__
+#include<immintrin.h>
+#endif
+#ifdef _OPENMP
+#include<omp.h>
+#else
+#define omp_get_thread_num() 0
+#define omp_get_max_threads() 1
+#endif
 
 /*----VARIABLES----*/
 /*-----------------*/
 /*--Pre-definitions--*/
 #define NDISP 20        // number of points to display (every 5%)
 #define NSTORE 1e7      // maximum number of points to store
+#define NREP 64         // replicas in multi-spin coding (bits of uint64_t)
+#define THRBITS 32      // precision of the acceptance thresholds in multi-spin coding
+#define RNDBUF 256      // random numbers generated at a time
 
 /*--Global variables--*/        // iterators?
 int Lx,                  // length of the lattice
     Ly,                  // height of the lattice
     N;                   // number of particles (Lx*Ly)
 
-int *lat = NULL,         // lattice                                                 TODO as char
-    //*ns[4] = {1, -1, Lx, -Lx},              // neighbour spins ({1, -1, L, -L} for 2D squared lattice)
+int8_t *lat = NULL;      // lattice
+int //*ns[4] = {1, -1, Lx, -Lx},              // neighbour spins ({1, -1, L, -L} for 2D squared lattice)
     *rn, *ln, *un, *dn;  // relative positions of neighbours
 
 float   J = 1,
@@ -32,6 +49,30 @@ double  e,               // energy density
         m,               // magnetization density
         prob[5];         // Metropolis probability table for exponents -8, -4, 0 (++--), +4 (+++-), +8 (++++)
 
+/*--PRNG--*/
+uint64_t seed,           // seed of all the streams (-S, else the time)
+         rnd,            // last random number of this thread
+         rnd_buf[RNDBUF];// next random numbers of this thread
+int      rnd_pos;        // next random number in rnd_buf (RNDBUF: empty)
+prng_t   rng;            // xoshiro256** stream of this thread (stream = thread)
+#pragma omp threadprivate(rnd, rnd_buf, rnd_pos, rng)
+
+/*--Multi-spin coding--*/
+int msc = 0;             // run NREP replicas, one per bit
+uint64_t *mlat = NULL;   // multi-spin coded lattice, bit r is the spin of replica r (1 -> +1, 0 -> -1)
+uint64_t thr[5];         // prob[] as THRBITS-bit thresholds, 1<<THRBITS means always accept
+double  er[NREP],        // energy density of every replica
+        mr[NREP];        // magnetization density of every replica
+
+/*--Checkerboard--*/
+int cb = 0;              // red/black sweep instead of typewriter order
+int32_t ithr[5];         // prob[] as 30-bit thresholds, 1<<30 means always accept
+int nthreads = 0;        // threads for the checkerboard sweep (0: OpenMP default)
+#ifdef __AVX2__
+__m256i xs[4];           // xoshiro128+ state, 8 independent streams
+#pragma omp threadprivate(xs)
+#endif
+
 FILE    //*in_file,        // input file
         //*bk_file,        // back up file
         *out_file;       // output file
@@ -44,12 +85,73 @@ double invN,         // 1/N
 
 /*----FUNCTIONS----*/
 /*-----------------*/
+/*--PRNG--*/
+void rand64(){               // next random number of this thread in rnd, generated RNDBUF at a time
+    if (rnd_pos == RNDBUF){
+        prng_fill(&rng, rnd_buf, RNDBUF);
+        rnd_pos = 0;
+    }
+    rnd = rnd_buf[rnd_pos++];
+}
+uint64_t bernoulli_mask(uint32_t t){
+    /* Every bit is set independently with probability t/2^THRBITS: bit r of the
+     * b-th random word is the b-th most significant bit of replica r's random
+     * number, so comparing against t goes from the top bit down and stops as
+     * soon as all 64 comparisons are decided (about 8 words on average).
+     */
+    static uint64_t lt, eq;     // random < t already decided, still equal to t
+    static int b;
+
+    lt = 0;
+    eq = ~0ULL;
+    for (b=THRBITS-1; b>=0 && eq; b--){
+        rand64();
+        if ((t>>b) & 1){
+            lt |= eq & ~rnd;
+            eq &= rnd;
+        }
+        else
+            eq &= ~rnd;
+    }
+    return lt;
+}
+void seed_stream(uint64_t seed, int thread){
+    /*stream number thread of xoshiro256** for seed (prng.h), and the xoshiro128+ states from it*/
+    prng_seed(&rng, PRNG_XOSHIRO, seed, thread);
+    rnd_pos = RNDBUF;
+#ifdef __AVX2__
+    uint32_t state[4][8];
+    for (int k=0; k<32; k++){         // xoshiro128+ only needs a non-zero state
+        rand64();
+        state[k>>3][k&7] = (uint32_t) (rnd>>32);
+    }
+    for (int k=0; k<4; k++)
+        xs[k] = _mm256_loadu_si256((__m256i *) state[k]);
+#endif
+}
 /*--init--*/
 void get_data(int argc, char *argv[]){
     /*Get data from input (by now exec args, TODO entry file)*/
-    if (argc == 1 || argc > 7){
-        printf("Usage:\t %s Lx Ly output_file [OPTIONAL] niter J beta\n", argv[0]);
-        printf("\tdefault: niter=1E+03, J=1, beta=0.44\n");
+    int opt;
+    int seed_given = 0;
+    while ((opt = getopt(argc, argv, "rct:S:")) != -1){ // options go before the positional arguments
+        switch (opt){
+            case 'S': sscanf(optarg, "%lu", &seed); seed_given = 1; break;
+            case 'r': msc = 1; break;
+            case 'c': cb = 1; break;
+            case 't': cb = 1; sscanf(optarg, "%d", &nthreads); break;
+            default: argc = 0;                          // show usage
+        }
+    }
+    argc -= optind-1;           // positional arguments as if there were no options
+    argv += optind-1;
+
+    if (argc < 4 || argc > 7){
+        printf("Usage:\t %s [-r|-c|-t nthreads] [-S seed] Lx Ly output_file [OPTIONAL] niter J beta\n", argv[0]);
+        printf("\tdefault: niter=1E+03, J=1, beta=0.44, seed: time\n");
+        printf("\t-r: multi-spin coding, %d replicas with independent randoms (one per bit)\n", NREP);
+        printf("\t-c: checkerboard sweep (SIMD if compiled with -mavx2), Lx and Ly even\n");
+        printf("\t-t: checkerboard sweep in row strips on nthreads threads (compiled with -fopenmp)\n");
         exit(1);
     }
 
@@ -61,7 +163,17 @@ void get_data(int argc, char *argv[]){
     sscanf((argc==7) ? argv[6] : "0.44", "%f", &beta);
 
     if (Lx <= 1 || Ly <= 1){printf("ERROR: L must be >=2\n"); exit(1);}
+    if (cb && (Lx&1 || Ly&1)){printf("ERROR: checkerboard needs even Lx and Ly\n"); exit(1);}
+    if (cb && msc){printf("ERROR: -r and -c/-t are exclusive\n"); exit(1);}
+    if (nthreads < 0){printf("ERROR: nthreads must be positive\n"); exit(1);}
+#ifdef _OPENMP
+    omp_set_dynamic(0);         // threadprivate PRNG states must survive between sweeps
+    if (nthreads) omp_set_num_threads(nthreads);
+#else
+    if (nthreads > 1) printf("WARNING: compiled without OpenMP, running on 1 thread\n");
+#endif
     if (beta<=0){printf("ERROR: beta must be positive\n"); exit(1);}
+    if (!seed_given) seed = (uint64_t) time(0);
 }
 void setup(){
     /*--Remaining global variables--*/
@@ -70,23 +182,29 @@ void setup(){
     invN = (double) 1/N;
     JinvN = (double) J/N;
 
-    for (i=0; i<5; i++)
+    for (i=0; i<5; i++){
         prob[i] = exp(kappa * (-8+4*i));
+        thr[i] = (prob[i] >= 1) ? 1ULL<<THRBITS : (uint64_t) (prob[i] * 0x1p+32);   // below 2^-32: never
+        ithr[i] = (prob[i] >= 1) ? 1<<30 : (int32_t) (prob[i] * 0x1p+30);
+    }
 
     /*--PRNG--*/
-    srand(time(0));
+    #pragma omp parallel
+    seed_stream(seed, omp_get_thread_num());
 
-    /*--Lattice--*/                            // TODO char, better PRNG
-    lat = realloc(lat, sizeof(int) * N);       // realocating memory
-    for (i=0; i<N; i++)
-        lat[i] = (rand()&1) * 2 - 1;
+    /*--Lattice--*/
+    lat = realloc(lat, sizeof(int8_t) * N);    // realocating memory
+    for (i=0; i<N; i++){                       // from stream 0 (main thread)
+        rand64();
+        lat[i] = (rnd>>63) * 2 - 1;
+    }
 
     rn = realloc(rn, sizeof(int) * Lx);
     ln = realloc(ln, sizeof(int) * Lx);
     un = realloc(un, sizeof(int) * Ly);
     dn = realloc(dn, sizeof(int) * Ly);
 
-    for (i=0; i<Lx && i<Ly; i++){
+    for (i=0; i<Lx || i<Ly; i++){
         if (i < Lx-1){
             rn[i] = +1;
             ln[i] = -1;
@@ -101,6 +219,16 @@ void setup(){
     rn[Lx-1] = -ln[0];
     dn[0] = (Ly-1)*Lx;
     un[Ly-1] = -dn[0];
+    ln[Lx-1] = -1;          // not set in the loop above
+    dn[Ly-1] = -Lx;
+
+    if (msc){
+        mlat = realloc(mlat, sizeof(uint64_t) * N);
+        for (i=0; i<N; i++){            // every replica starts from a different random lattice
+            rand64();
+            mlat[i] = rnd;
+        }
+    }
 }
 /*--Monte Carlo update--*/
 void metropolis_update(){
@@ -121,8 +249,139 @@ void metropolis_update(){
         Q = prob[(ss+4)>>1];       // {-8,-4,0,+4,+8} -> {0,1,2,3,4}   (simplification: 2x -> (2x+8)/4 = (x+4)/2)
         if (Q>=1)
             lat[site_u] = -lat[site_u];
-        else if ((double) rand()/RAND_MAX < Q)
-            lat[site_u] = -lat[site_u];
+        else {
+            rand64();
+            if ((rnd>>11) * 0x1p-53 < Q)
+                lat[site_u] = -lat[site_u];
+        }
+
+        site_u++;
+    }
+    }
+}
+void checkerboard_site(int site, int x, int y){
+    /*scalar update of one site with integer thresholds*/
+    int ss;
+
+    ss = lat[site + rn[x]] + lat[site + ln[x]] + lat[site + un[y]] + lat[site + dn[y]];
+    ss *= -lat[site];
+    rand64();
+    if ((int32_t) (rnd>>34) < ithr[(ss+4)>>1])
+        lat[site] = -lat[site];
+}
+#ifdef __AVX2__
+static inline __m256i xoshiro128p(){
+    /*next 8 random numbers of the vectorized xoshiro128+*/
+    __m256i r = _mm256_add_epi32(xs[0], xs[3]),
+            t = _mm256_slli_epi32(xs[1], 9);
+
+    xs[2] = _mm256_xor_si256(xs[2], xs[0]);
+    xs[3] = _mm256_xor_si256(xs[3], xs[1]);
+    xs[1] = _mm256_xor_si256(xs[1], xs[2]);
+    xs[0] = _mm256_xor_si256(xs[0], xs[3]);
+    xs[2] = _mm256_xor_si256(xs[2], t);
+    xs[3] = _mm256_or_si256(_mm256_slli_epi32(xs[3], 11), _mm256_srli_epi32(xs[3], 21));
+    return r;
+}
+int checkerboard_simd(int8_t *row, int8_t *up, int8_t *down, int x0, int x1, int par){
+    /* Updates the sites x0 <= x < x1 of row whose x has parity par, 32 sites per
+     * iteration (half of them wasted). Returns where it stopped.
+     */
+    const __m256i thrv = _mm256_setr_epi32(ithr[0], ithr[1], ithr[2], ithr[3], ithr[4], 0, 0, 0),
+                  perm = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7),     // undo the lane interleaving of packs
+                  four = _mm256_set1_epi8(4),
+                  low  = _mm256_set1_epi8(0x0F),
+                  flip = _mm256_set1_epi8((int8_t) 0xFE),               // s^0xFE = -s for s=+-1
+                  even = _mm256_set1_epi16(0x00FF);
+    __m256i s, sum, idx, acc[4], p;
+    int x, k;
+
+    for (x=x0; x+32<=x1; x+=32){
+        s   = _mm256_loadu_si256((__m256i *) (row+x));
+        sum = _mm256_add_epi8(_mm256_add_epi8(_mm256_loadu_si256((__m256i *) (row+x-1)),
+                                              _mm256_loadu_si256((__m256i *) (row+x+1))),
+                              _mm256_add_epi8(_mm256_loadu_si256((__m256i *) (up+x)),
+                                              _mm256_loadu_si256((__m256i *) (down+x))));
+        sum = _mm256_sign_epi8(sum, _mm256_sub_epi8(_mm256_setzero_si256(), s));     // -s*sum
+        idx = _mm256_and_si256(_mm256_srli_epi16(_mm256_add_epi8(sum, four), 1), low);  // (ss+4)>>1
+
+        for (k=0; k<4; k++){        // 8 sites per 32-bit comparison
+            p = _mm256_cvtepi8_epi32(_mm_loadl_epi64((__m128i *) ((int8_t *) &idx + 8*k)));
+            acc[k] = _mm256_cmpgt_epi32(_mm256_permutevar8x32_epi32(thrv, p),
+                                        _mm256_srli_epi32(xoshiro128p(), 2));
+        }
+        p = _mm256_packs_epi16(_mm256_packs_epi32(acc[0], acc[1]), _mm256_packs_epi32(acc[2], acc[3]));
+        p = _mm256_permutevar8x32_epi32(p, perm);
+        p = _mm256_and_si256(p, ((x^par)&1) ? _mm256_slli_epi16(even, 8) : even);    // only this colour
+        _mm256_storeu_si256((__m256i *) (row+x), _mm256_xor_si256(s, _mm256_and_si256(p, flip)));
+    }
+    return x;
+}
+#endif
+void checkerboard_update(){
+    /* Red/black sweep: sites of one colour only have neighbours of the other
+     * colour, so a whole colour can be updated at once. Columns 0 and Lx-1
+     * wrap around and are done one by one.
+     * Every thread takes a strip of consecutive rows with its own PRNG, the
+     * end of the omp for is the barrier between colours.
+     */
+    #pragma omp parallel
+    {
+    int x, y, col, par;
+
+    for (col=0; col<2; col++){
+        #pragma omp for schedule(static)
+        for (y=0; y<Ly; y++){
+            par = (y+col) & 1;          // sites with (x+y)%2 == col have x%2 == par
+            x = 1;
+#ifdef __AVX2__
+            x = checkerboard_simd(lat + y*Lx, lat + y*Lx + un[y], lat + y*Lx + dn[y], 1, Lx-1, par);
+#endif
+            if ((x&1) != par) x++;
+            for (; x<Lx-1; x+=2)
+                checkerboard_site(y*Lx + x, x, y);
+            if (par == 0)
+                checkerboard_site(y*Lx, 0, y);
+            else
+                checkerboard_site(y*Lx + Lx-1, Lx-1, y);
+        }
+    }
+    }
+}
+void msc_update(){
+    /* Metropolis sweep of the NREP replicas at once. The bits of s^neighbour are
+     * the antiparallel bonds, their bit-sliced sum c (0..4) gives Q=prob[c], since
+     * -s*sum(neighbours) = 2c-4. Every replica draws its own random numbers.
+     */
+    static int site_u;
+    static uint64_t s, a, b, c, d,      // site and antiparallel neighbours
+                    s1, s2, c1, c2,     // half adders
+                    b0, b1, b2,         // bits of c
+                    acc;                // replicas that flip
+    static int nc;                      // number of antiparallel neighbours
+
+    site_u = 0;
+    for (j=0; j<Ly; j++) {
+    for (i=0; i<Lx; i++) {
+        s = mlat[site_u];
+        a = s ^ mlat[site_u + rn[i]];
+        b = s ^ mlat[site_u + ln[i]];
+        c = s ^ mlat[site_u + un[j]];
+        d = s ^ mlat[site_u + dn[j]];
+
+        s1 = a ^ b; c1 = a & b;
+        s2 = c ^ d; c2 = c & d;
+        b0 = s1 ^ s2;
+        b1 = c1 ^ c2 ^ (s1 & s2);
+        b2 = c1 & c2;                   // only if all four are antiparallel
+
+        acc = 0;
+        for (nc=0; nc<5; nc++){         // replicas with c==nc flip with probability prob[nc]
+            a = (nc==4) ? b2 : ~b2 & ((nc&1) ? b0 : ~b0) & ((nc&2) ? b1 : ~b1);
+            if (a && thr[nc])
+                acc |= (thr[nc] >> THRBITS) ? a : a & bernoulli_mask(thr[nc]);
+        }
+        mlat[site_u] = s ^ acc;
 
         site_u++;
     }
@@ -130,18 +389,15 @@ void metropolis_update(){
 }
 /*--measurements--*/
 void measure() {
-    static int site_m, py_m;      // site in lat, TODO y-axis position of upper neighbour
-    static double E, M;
+    int64_t E = 0, M = 0;
 
-    /*reset measurements*/
-    E = 0;
-    M = 0;
-    site_m = 0;
-    /*iterate lattice*/
-    for (j=0; j<Ly; j++) {
-        for (i=0; i<Lx; i++) {
+    /*iterate lattice, rows reduced among threads*/
+    #pragma omp parallel for schedule(static) reduction(+:E,M)
+    for (int y=0; y<Ly; y++) {
+        int site_m = y*Lx;
+        for (int x=0; x<Lx; x++) {
             M += lat[site_m];
-            E += lat[site_m] * ( lat[site_m + rn[i]] + lat[site_m + un[j]]);
+            E += lat[site_m] * ( lat[site_m + rn[x]] + lat[site_m + un[y]]);
             site_m++;
         }
     }
@@ -149,8 +405,52 @@ void measure() {
     e = (double) -JinvN * E;
     m = (double) invN * M;
 }
+void add_bits(uint64_t *ctr, uint64_t w){
+    /*add the bits of w to bit-sliced counters (bit r of ctr[b] is bit b of counter r)*/
+    static uint64_t carry;
+    static int b;
+
+    for (b=0; w; b++){
+        carry = ctr[b] & w;
+        ctr[b] ^= w;
+        w = carry;
+    }
+}
+void msc_measure() {
+    static uint64_t cup[32], cunsat[32];     // spins up and unsatisfied bonds for every replica
+    static int site_m, r, b;
+    static int64_t M, E;
+    static double em, mm;
+
+    for (b=0; b<32; b++)
+        cup[b] = cunsat[b] = 0;
+    site_m = 0;
+    for (j=0; j<Ly; j++) {
+        for (i=0; i<Lx; i++) {
+            add_bits(cup, mlat[site_m]);
+            add_bits(cunsat, mlat[site_m] ^ mlat[site_m + rn[i]]);
+            add_bits(cunsat, mlat[site_m] ^ mlat[site_m + un[j]]);
+            site_m++;
+        }
+    }
+
+    em = mm = 0;
+    for (r=0; r<NREP; r++){
+        M = E = 0;
+        for (b=0; b<32; b++){
+            M += (int64_t) ((cup[b] >> r) & 1) << b;
+            E += (int64_t) ((cunsat[b] >> r) & 1) << b;
+        }
+        mr[r] = (double) invN * (2*M - N);              // N_up - N_down
+        er[r] = (double) -JinvN * (2*N - 2*E);          // satisfied - unsatisfied bonds
+        em += er[r];
+        mm += mr[r];
+    }
+    e = em / NREP;
+    m = mm / NREP;
+}
 /*--output--*/
-void disp_lattice(int *la) {
+void disp_lattice(int8_t *la) {
     int y;
     for (j=0; j<Ly; j++){
         y = j*Lx;
@@ -162,7 +462,24 @@ void disp_lattice(int *la) {
     }
     puts("");       // new line
 }
+void disp_msc_lattice() {       // first replica
+    for (j=0; j<Ly; j++){
+        for (i=0; i<Lx; i++){
+            if (mlat[j*Lx+i] & 1) printf("+");
+            else printf("-");
+        }
+        puts("");
+    }
+    puts("");
+}
 void disp_init_info() {
+    if (msc) printf("replicas: %d (multi-spin coding)\n", NREP);
+#ifdef __AVX2__
+    if (cb) printf("checkerboard sweep (AVX2) on %d thread(s)\n", omp_get_max_threads());
+#else
+    if (cb) printf("checkerboard sweep (scalar) on %d thread(s)\n", omp_get_max_threads());
+#endif
+    printf("seed: %lu (xoshiro256**, one stream per thread)\n", seed);
     printf("iterations: %3.2g\nparticles: %d\nbeta*J = %f ", nmeas, N, kappa);
     if (kappa - log(1+sqrt(2))/2 < 1e-6)    printf("= ");
     else if (kappa < log(1+sqrt(2))/2)      printf("< ");
@@ -172,6 +489,33 @@ void disp_init_info() {
 
 /*----PROGRAM----*/
 /*-----------------*/
+void run_msc(int ndisp, int nstore){
+    /*same run as main() for NREP replicas, output lines are e_0 m_0 e_1 m_1 ...*/
+    msc_measure();
+    printf("Initial lattice (replica 0), mean over replicas:\ne=%4.3f\tm=%4.3f\n", e, m);
+    disp_msc_lattice();
+
+    /*Thermalization*/
+    for (n=0; n<nther; n++) {
+        msc_update();
+    }
+
+    /*Measurements*/
+    for (n=0; n<nmeas; n++) {
+        if (n%nstore == 0) {
+            msc_measure();
+            fputs("\n", out_file);
+            for (int r=0; r<NREP; r++)
+                fprintf(out_file, "%6.4f\t%6.4f\t", er[r], mr[r]);
+            if (n%ndisp == 0 || n == nmeas-1){
+                printf("%3.0f%%:\te=%4.3f\tm=%4.3f\n", (float) n/nmeas*100, e, m);
+                disp_msc_lattice();
+            }
+        }
+        msc_update();
+    }
+}
+
 int main(int argc, char *argv[]){
     get_data(argc, argv);       // Getting input data
     setup();                    // Setting up and generating the lattice
@@ -182,13 +526,18 @@ int main(int argc, char *argv[]){
     if (nstore==0) nstore=1;
 
     disp_init_info();               // disp some initial info
+    if (msc){
+        run_msc(ndisp, nstore);
+        return 0;
+    }
     measure();
     printf("Initial lattice:\ne=%4.3f\tm=%4.3f\n", e, m);
     disp_lattice(lat);
 
     /*Thermalization*/
     for (n=0; n<nther; n++) {
-        metropolis_update();
+        if (cb) checkerboard_update();
+        else    metropolis_update();
     }
 
     /*Measurements*/
@@ -201,7 +550,8 @@ int main(int argc, char *argv[]){
                 disp_lattice(lat);
             }
         }
-        metropolis_update();
+        if (cb) checkerboard_update();
+        else    metropolis_update();
     }
     return 0;
 }
@@ -1,74 +1,444 @@
 /*
  * Estimation of pi from the volume of an n-sphere using the
- * most simple Monte Carlo method
+ * most simple Monte Carlo method, quasi-Monte Carlo with
+ * scrambled Sobol points (-q), or the product of the ratios
+ * V_k/V_{k-1} for high dimensions (-m ratio|cond)
+ * (compile with -O3 -march=native to vectorize the batches
+ *  and with -fopenmp to split the samples among threads)
 */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 #include <time.h>
 #include <math.h>
+#include "../prng.h"
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#define omp_get_thread_num() 0
+#define omp_get_num_threads() 1
+#define omp_get_max_threads() 1
+#endif
+
+#define LANES 8         // interleaved xoshiro256** streams per thread, one per SIMD lane
+#define BATCH 1024      // points per batch, multiple of LANES
+#define MAXSOBOL 21     // dimensions of the Sobol points
+#define SOBOL_BITS 64   // bits of the direction numbers, 2^64 points per replicate
+#define MINPILOT 100    // pilot points per ratio of -m, at least
+
+/* Direction numbers of Joe and Kuo (new-joe-kuo-6.21201) for dimensions 2..21:
+ * degree s and coefficients a of the primitive polynomial, initial m_1..m_s.
+ * Dimension 1 is the van der Corput sequence (all m_i = 1).
+ */
+static const struct {int s, a, m[7];} joe_kuo[MAXSOBOL-1] = {
+    {1,  0, {1}},                       {2,  1, {1, 3}},
+    {3,  1, {1, 3, 1}},                 {3,  2, {1, 1, 1}},
+    {4,  1, {1, 1, 3, 3}},              {4,  4, {1, 3, 5, 13}},
+    {5,  2, {1, 1, 5, 5, 17}},          {5,  4, {1, 1, 5, 5, 5}},
+    {5,  7, {1, 1, 7, 11, 19}},         {5, 11, {1, 1, 5, 1, 1}},
+    {5, 13, {1, 1, 1, 3, 11}},          {5, 14, {1, 3, 5, 5, 31}},
+    {6,  1, {1, 3, 3, 9, 7, 49}},       {6, 13, {1, 1, 1, 15, 21, 21}},
+    {6, 16, {1, 3, 1, 13, 27, 49}},     {6, 19, {1, 1, 1, 15, 7, 5}},
+    {6, 22, {1, 3, 1, 15, 13, 25}},     {6, 25, {1, 1, 5, 5, 19, 61}},
+    {7,  1, {1, 3, 7, 11, 23, 15, 103}}, {7,  4, {1, 3, 7, 13, 13, 15, 69}}
+};
 
 
 double volume_factor (int n);
 
+double wall_time(){
+    /*seconds from a monotonic clock*/
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+static inline void fill_lanes(uint64_t s[4][LANES], uint64_t *out, int n){
+    /* n randoms (multiple of LANES) from the LANES streams of s, one per lane:
+     * xoshiro256** with the multiplications by 5 and 9 as shifts and adds, so
+     * the loop over the lanes vectorizes without 64-bit multiplies.
+     */
+    uint64_t t, r;
+    for (int j=0; j<n; j+=LANES)
+        for (int l=0; l<LANES; l++){
+            r = (s[1][l] << 2) + s[1][l];               // s1*5
+            r = (r << 7) | (r >> 57);
+            out[j+l] = (r << 3) + r;                    // *9
+            t = s[1][l] << 17;
+            s[2][l] ^= s[0][l];
+            s[3][l] ^= s[1][l];
+            s[1][l] ^= s[2][l];
+            s[0][l] ^= s[3][l];
+            s[2][l] ^= t;
+            s[3][l] = (s[3][l] << 45) | (s[3][l] >> 19);
+        }
+}
+
+uint64_t inside(uint64_t s[4][LANES], int dim, int npts){
+    /*points out of npts (up to BATCH) uniform in [-1,1)^dim with r^2<=1*/
+    uint64_t rnd[BATCH], u, count = 0;
+    double r2[BATCH], x;
+    int p, k;
+
+    for (p=0; p<BATCH; p++) r2[p] = 0;                  // all of them, the loop below fills the whole batch
+    for (k=0; k<dim; k++) {
+        fill_lanes(s, rnd, BATCH);
+        for (p=0; p<BATCH; p++) {
+            u = (rnd[p] >> 12) | 0x3FF0000000000000ULL;    // bits of a double in [1,2)
+            memcpy(&x, &u, sizeof(x));
+            x = 2*x - 3;                                    // uniform distribution in [-1,1)
+            r2[p] += x*x;                                   // term of r² = x²
+        }
+    }
+    for (p=0; p<npts; p++)
+        count += (r2[p] <= 1.0);    // add to count if point inside circle, including border
+    return count;
+}
+
+uint64_t run_mc(int dim, uint64_t niter, uint64_t seed){
+    /*points inside the sphere out of niter pseudo-random ones*/
+    uint64_t count = 0;
+    #pragma omp parallel reduction(+:count)
+    {
+    /* Every thread gets an equal share of the points and LANES consecutive
+     * xoshiro256** streams (2^128 numbers apart), so the result only depends
+     * on the seed and the number of threads.
+     */
+    int nthr = omp_get_num_threads(), thr = omp_get_thread_num();
+    uint64_t s[4][LANES], left = niter/nthr + ((uint64_t) thr < niter%nthr);
+    prng_t g;
+    prng_seed(&g, PRNG_XOSHIRO, seed, thr*LANES);
+    for (int l=0; l<LANES; l++){
+        for (int w=0; w<4; w++) s[w][l] = g.s[w];
+        xoshiro256_jump(g.s);
+    }
+    for (; left >= BATCH; left -= BATCH)
+        count += inside(s, dim, BATCH);
+    if (left) count += inside(s, dim, left);
+    }
+    return count;
+}
+
+void sobol_directions(int dim, prng_t *g, uint64_t V[][SOBOL_BITS], uint64_t *shift){
+    /* Direction numbers V[k][b] (bit 63 is the first binary digit) of the first
+     * dim dimensions, scrambled with a random lower triangular binary matrix
+     * with unit diagonal per dimension (Matousek's linear scrambling), and a
+     * random digital shift per dimension to XOR into every point.
+     */
+    uint64_t v[SOBOL_BITS], row[SOBOL_BITS], r;
+    int k, b, c, s, a;
+    for (k=0; k<dim; k++){
+        if (k == 0)
+            for (b=0; b<SOBOL_BITS; b++) v[b] = 1ULL << (63-b);
+        else {
+            s = joe_kuo[k-1].s;
+            a = joe_kuo[k-1].a;
+            for (b=0; b<s; b++) v[b] = (uint64_t) joe_kuo[k-1].m[b] << (63-b);
+            for (b=s; b<SOBOL_BITS; b++){
+                v[b] = v[b-s] ^ (v[b-s] >> s);
+                for (c=1; c<s; c++)
+                    if ((a >> (s-1-c)) & 1) v[b] ^= v[b-c];
+            }
+        }
+        for (b=0; b<SOBOL_BITS; b++){       // row b of the matrix: digits 0..b, digit b set
+            prng_fill(g, &r, 1);
+            row[b] = (r & (~0ULL << (63-b))) | (1ULL << (63-b));
+        }
+        for (c=0; c<SOBOL_BITS; c++){       // digit b of the scrambled v[c] is the parity of row b & v[c]
+            V[k][c] = 0;
+            for (b=0; b<SOBOL_BITS; b++)
+                V[k][c] |= (uint64_t) __builtin_parityll(row[b] & v[c]) << (63-b);
+        }
+        prng_fill(g, shift + k, 1);
+    }
+}
+
+uint64_t sobol_inside(int dim, uint64_t V[][SOBOL_BITS], const uint64_t *shift, uint64_t n0, int npts){
+    /*points with r^2<=1 among the npts (up to BATCH) Sobol points from index n0, in Gray code order*/
+    uint64_t X, u, g = n0 ^ (n0 >> 1), count = 0;
+    double r2[BATCH], x;
+    int c[BATCH], p, k, b;
+
+    for (p=0; p<npts; p++){
+        r2[p] = 0;
+        c[p] = __builtin_ctzll(n0 + p + 1);         // digit that changes to the next point
+    }
+    for (k=0; k<dim; k++){
+        for (X=shift[k], b=0; b<SOBOL_BITS; b++)    // point n0 from its Gray code
+            if ((g >> b) & 1) X ^= V[k][b];
+        for (p=0; p<npts; p++){
+            u = (X >> 12) | 0x3FF0000000000000ULL;  // bits of a double in [1,2)
+            memcpy(&x, &u, sizeof(x));
+            x = 2*x - 3;
+            r2[p] += x*x;
+            X ^= V[k][c[p]];
+        }
+    }
+    for (p=0; p<npts; p++)
+        count += (r2[p] <= 1.0);
+    return count;
+}
+
+uint64_t run_sobol(int dim, uint64_t npts, uint64_t V[][SOBOL_BITS], const uint64_t *shift){
+    /*points inside the sphere out of the first npts of one scrambled Sobol sequence*/
+    uint64_t count = 0;
+    #pragma omp parallel reduction(+:count)
+    {
+    int nthr = omp_get_num_threads(), thr = omp_get_thread_num();
+    uint64_t n0 = npts/nthr * thr + ((uint64_t) thr < npts%nthr ? (uint64_t) thr : npts%nthr),
+             left = npts/nthr + ((uint64_t) thr < npts%nthr);
+    for (; left >= BATCH; left -= BATCH, n0 += BATCH)
+        count += sobol_inside(dim, V, shift, n0, BATCH);
+    if (left) count += sobol_inside(dim, V, shift, n0, left);
+    }
+    return count;
+}
+
+double pi_from(double p, int dim){
+    /*pi from the fraction p of the cube [-1,1]^dim inside the sphere*/
+    return pow(1/volume_factor(dim) * p * pow(2,dim), (double)1 / ((int)dim/2));
+}
+
+double volume(int n){
+    /*exact volume of the n-sphere, for the exact errors*/
+    return volume_factor(n) * pow(M_PI, n/2);
+}
+
+void ratio_batch(uint64_t s[4][LANES], int k, int npts, int cond, double *a1, double *a2){
+    /* npts (up to BATCH) values for q_k = V_k/(2 V_{k-1}) added to a1 and their
+     * squares to a2. A point uniform in the (k-1)-ball has radius rho with
+     * rho^(k-1) uniform (the direction doesn't matter), and with t uniform in
+     * [-1,1) it is inside the k-ball if rho^2+t^2<=1: the value is that, or
+     * its expectation over t, sqrt(1-rho^2), if cond.
+     */
+    uint64_t r1[BATCH], r2[BATCH];
+    double rho2, t, v, e = 2.0/(k-1);
+    fill_lanes(s, r1, BATCH);
+    fill_lanes(s, r2, BATCH);
+    for (int p=0; p<npts; p++){
+        rho2 = pow(1 - (r1[p] >> 11) * 0x1p-53, e);    // (0,1]^(2/(k-1))
+        if (cond)
+            v = sqrt(1 - rho2);
+        else {
+            t = (r2[p] >> 11) * 0x1p-52 - 1;
+            v = (rho2 + t*t <= 1);
+        }
+        *a1 += v;
+        *a2 += v*v;
+    }
+}
+
+void run_ratio(int dim, const uint64_t *n, int cond, uint64_t seed, double *s1, double *s2){
+    /*sums s1[k] and s2[k] of the values of ratio_batch and their squares for n[k] points, k=2..dim*/
+    for (int k=2; k<=dim; k++) s1[k] = s2[k] = 0;
+    #pragma omp parallel
+    {
+    int nthr = omp_get_num_threads(), thr = omp_get_thread_num(), k;
+    uint64_t s[4][LANES], left;
+    double a1[dim+1], a2[dim+1];
+    prng_t g;
+    prng_seed(&g, PRNG_XOSHIRO, seed, thr*LANES);
+    prng_long_jump(&g);                             // away from the streams of Monte Carlo
+    prng_long_jump(&g);                             // and of the scramblings of Sobol
+    for (int l=0; l<LANES; l++){
+        for (int w=0; w<4; w++) s[w][l] = g.s[w];
+        xoshiro256_jump(g.s);
+    }
+    for (k=2; k<=dim; k++){
+        a1[k] = a2[k] = 0;
+        for (left = n[k]/nthr + ((uint64_t) thr < n[k]%nthr); left >= BATCH; left -= BATCH)
+            ratio_batch(s, k, BATCH, cond, a1 + k, a2 + k);
+        if (left) ratio_batch(s, k, left, cond, a1 + k, a2 + k);
+    }
+    #pragma omp critical
+    for (k=2; k<=dim; k++){
+        s1[k] += a1[k];
+        s2[k] += a2[k];
+    }
+    }
+}
+
 int main(int argc, char *argv[]){
 
-    int dim, niter;             // niter up to 2e+9
+    int dim, nthreads = 0, opt, nrep = 0, mode = 0;        // mode: 0 mc, 1 ratio, 2 cond
+    uint64_t niter,             // up to 2^64, 1e12 and more
+             seed = time(0);
+    double nit;
 
     /* User input control */
+    while ((opt = getopt(argc, argv, "t:S:q:m:")) != -1){   // options go before the positional arguments
+        switch (opt){
+            case 'm':
+                if      (!strcmp(optarg, "mc"))    mode = 0;
+                else if (!strcmp(optarg, "ratio")) mode = 1;
+                else if (!strcmp(optarg, "cond"))  mode = 2;
+                else argc = 0;
+                break;
+            case 't': sscanf(optarg, "%d", &nthreads); break;
+            case 'q': sscanf(optarg, "%d", &nrep); if (nrep < 2) argc = 0; break;
+            case 'S': sscanf(optarg, "%lu", &seed); break;
+            default: argc = 0;                          // show usage
+        }
+    }
+    argc -= optind-1;           // positional arguments as if there were no options
+    argv += optind-1;
     switch (argc) {                 ////////////
         case 2:
-            sscanf(argv[1], "%d", &niter);
+            sscanf(argv[1], "%lf", &nit);               // also 1e12
             dim = 2;
             break;
         case 3:
-            sscanf(argv[1], "%d", &niter);
+            sscanf(argv[1], "%lf", &nit);
             sscanf(argv[2], "%d", &dim);
             break;
         default:
-            printf("Usage:\t %s niter [OPTIONAL] dim\nDefault dim=2\n", argv[0]);
+            printf("Usage:\t %s [-t nthreads] [-S seed] [-q nrep] [-m mode] niter [OPTIONAL] dim\nDefault dim=2, threads: OpenMP default, seed: time\n", argv[0]);
+            printf("-m mc:    points in the cube [-1,1]^dim inside the sphere (default), useless beyond dim~15\n");
+            printf("-m ratio: V_dim = 2 prod_k 2q_k, q_k = V_k/(2V_{k-1}) the fraction of points uniform in\n");
+            printf("          the (k-1)-ball times [-1,1] inside the k-ball, q_k>0.1 up to dim 100\n");
+            printf("-m cond:  as ratio, each point counting its probability to be inside (less variance)\n");
+            printf("-q: quasi-Monte Carlo, niter Sobol points in nrep (>=2) independently scrambled\n");
+            printf("    replicates (dim<=%d) for the error, compared with Monte Carlo\n", MAXSOBOL);
             exit(1);
     }
 
-    if (niter <= 0) {printf("Error: niter must be positive\n"); exit(1);}
+    if (nit < 1 || nit > 1.8e19) {printf("Error: niter must be positive (up to 1.8e19)\n"); exit(1);}
     if (dim <= 1) {printf("Error: dimension must be >=2\n"); exit(1);}
+    if (nthreads < 0) {printf("Error: threads must be positive\n"); exit(1);}
+    if (nrep && dim > MAXSOBOL) {printf("Error: Sobol points up to dimension %d\n", MAXSOBOL); exit(1);}
+    if (nrep && nit < nrep) {printf("Error: niter must be at least nrep\n"); exit(1);}
+    if (nrep && mode) {printf("Error: -q samples the cube, not the ratios of -m\n"); exit(1);}
+    if (mode && nit < 2*MINPILOT*(dim-1)) {printf("Error: -m needs niter>=%d*(dim-1)\n", 2*MINPILOT); exit(1);}
+    niter = (uint64_t) nit;
+#ifdef _OPENMP
+    if (nthreads) omp_set_num_threads(nthreads);
+#else
+    if (nthreads > 1) printf("WARNING: compiled without OpenMP, running on 1 thread\n");
+#endif
 
     /* BEGIN */
-    double x[dim];
-    double pi;
-    long seed = time(0);
-    int count = 0;
+    double pi, t;
+    uint64_t count = 0;
 
     /* Display title and seed for random numbers */
     printf("####### MONTE CARLO SIMULATION: PI #######\n");
-    printf("niter: %g\tdimension: %d\tseed: %ld\n", (float) niter, dim, seed);
+    printf("niter: %g\tdimension: %d\tseed: %lu\tthreads: %d\n", (double) niter, dim, seed, omp_get_max_threads());
 
-    /* Monte Carlo */
-    srand(seed);
-
-    double r2;
-    for (int i=0; i<niter; i++) {
-        r2 = 0;
-        for (int k=0; k<dim; k++) {
-            x[k] = (double) rand()/RAND_MAX * 2 - 1;        // uniform distribution in [-1,1]
-            r2 += x[k]*x[k];                                // term of r² = x²
+    /* Quasi-Monte Carlo */
+    if (nrep){
+        uint64_t (*V)[SOBOL_BITS] = malloc(sizeof(uint64_t) * dim * SOBOL_BITS), shift[MAXSOBOL], npts = niter/nrep, c;
+        double pq = 0, pq2 = 0, tq, err_q, pi_r, err_mc;
+        prng_t g;
+        prng_seed(&g, PRNG_XOSHIRO, seed, 0);
+        prng_long_jump(&g);                         // away from the streams of Monte Carlo
+        printf("Sobol points: %d replicates of %lu\n", nrep, npts);
+        tq = wall_time();
+        for (int r=0; r<nrep; r++){
+            sobol_directions(dim, &g, V, shift);
+            c = run_sobol(dim, npts, V, shift);
+            count += c;
+            pi_r = pi_from((double) c/npts, dim);
+            pq += pi_r / nrep;
+            pq2 += pi_r*pi_r / nrep;
+        }
+        tq = wall_time() - tq;
+        free(V);
+        err_q = sqrt(fmax(pq2 - pq*pq, 0) / (nrep-1));      // of the mean of the replicates
+
+        t = wall_time();                            // Monte Carlo with the same points
+        uint64_t cm = run_mc(dim, npts*nrep, seed);
+        t = wall_time() - t;
+        double pm = (double) cm/(npts*nrep);
+        pi = pi_from(pm, dim);
+        err_mc = pi / ((int)dim/2) * sqrt((1-pm) / (pm * (npts*nrep-1)));  // delta method, for any dim
+
+        printf("mode\tpoints\t\tpi\t\terror\t\tdeviation\ttime (s)\terror^2*time\n");
+        printf("sobol\t%.3e\t%.10f\t%.3e\t%+.3f\t\t%.4f\t\t%.3e\n", (double) npts*nrep, pq, err_q, (pq-M_PI)/err_q, tq, err_q*err_q*tq);
+        printf("mc\t%.3e\t%.10f\t%.3e\t%+.3f\t\t%.4f\t\t%.3e\n", (double) npts*nrep, pi, err_mc, (pi-M_PI)/err_mc, t, err_mc*err_mc*t);
+        printf("Monte Carlo would need %.3g s (%.3g points) for the error of quasi-Monte Carlo, %.3g times longer\n",
+               t * pow(err_mc/err_q, 2), npts*nrep * pow(err_mc/err_q, 2), t/tq * pow(err_mc/err_q, 2));
+        return 0;
+    }
+
+    /* Product of ratios */
+    if (mode){
+        /* A tenth of the points go equally to every ratio, the rest in proportion
+         * to sd_k/q_k, which minimizes the variance of log V = sum_k log(2q_k):
+         * var_k/(q_k^2 n_k) summed over k (delta method, like the other errors).
+         */
+        uint64_t *n = calloc(dim+1, sizeof(uint64_t)), *n1 = calloc(dim+1, sizeof(uint64_t)), used = 0;    // k=0,1 unused
+        double *s1 = malloc(sizeof(double) * (dim+1)), *s2 = malloc(sizeof(double) * (dim+1)),
+               *u1 = malloc(sizeof(double) * (dim+1)), *u2 = malloc(sizeof(double) * (dim+1)),
+               q, var, qe, vare, w = 0, logV = log(2), rv = 0, rve = 0;
+        int k;
+        t = wall_time();
+        for (k=2; k<=dim; k++) used += n[k] = (niter/10/(dim-1) > MINPILOT) ? niter/10/(dim-1) : MINPILOT;
+        run_ratio(dim, n, mode == 2, seed, s1, s2);
+        for (k=2; k<=dim; k++){
+            q = s1[k]/n[k];
+            w += sqrt(fmax(s2[k]/n[k] - q*q, 1e-300)) / q;       // inf if q=0
+        }
+        for (k=2; k<=dim; k++){                     // equally if a pilot had no point inside
+            q = s1[k]/n[k];
+            n1[k] = isfinite(w) ? (uint64_t) ((niter - used) * (sqrt(fmax(s2[k]/n[k] - q*q, 1e-300)) / q) / w)
+                                : (niter - used)/(dim-1);
+        }
+        run_ratio(dim, n1, mode == 2, seed ^ 0x9E3779B97F4A7C15ULL, u1, u2);  // other streams
+        t = wall_time() - t;
+
+        printf("k\tpoints\t\tq_k\t\terror\t\texact q_k\n");
+        for (k=2; k<=dim; k++){
+            n[k] += n1[k];
+            s1[k] += u1[k];
+            s2[k] += u2[k];
+            q = s1[k]/n[k];
+            if (q == 0) {printf("Error: no point inside the %d-ball, increase niter\n", k); exit(1);}
+            var = (s2[k]/n[k] - q*q) * n[k]/(n[k]-1);
+            qe = volume(k) / (2*volume(k-1));
+            vare = (mode == 2) ? 2.0/(k+1) - qe*qe : qe*(1-qe);    // E[1-rho^2] = 2/(k+1)
+            logV += log(2*q);
+            rv += var / (q*q*n[k]);
+            rve += vare / (qe*qe*n[k]);
+            if (dim <= 12 || k == 2 || k == dim || k%10 == 0)
+                printf("%d\t%.3e\t%.8f\t%.2e\t%.8f\n", k, (double) n[k], q, sqrt(var/n[k]), qe);
         }
-        if (r2 <= 1.0) count++;       // add to count if point inside circle, including border
+        pi = pow(exp(logV) / volume_factor(dim), (double)1 / ((int)dim/2));
+        double exact_err = M_PI / ((int)dim/2) * sqrt(rve),
+               empirical_err = pi / ((int)dim/2) * sqrt(rv);
+
+        printf("Volume of %d-sphere: %.8g +- %.2g (exact %.8g)\n", dim, exp(logV), exp(logV)*sqrt(rv), volume(dim));
+        printf("Estimation of pi: %.5f +- %.5f (%.5f)\n", pi, exact_err, empirical_err);
+        printf("Deviation: %.5g sigmas\n", (pi-M_PI)/exact_err);
+        printf("Time: %.3f s\t%.4g samples/s\terror^2*time: %.3e\n", t, niter/t, exact_err*exact_err*t);
+        free(n); free(n1); free(s1); free(s2); free(u1); free(u2);
+        return 0;
     }
 
-    pi = (double) powf((double) 1/volume_factor(dim) * count/niter * pow(2,dim), (double)1 / ((int)dim/2));
+    /* Monte Carlo */
+    t = wall_time();
+    count = run_mc(dim, niter, seed);
+    t = wall_time() - t;
+
+    pi = pi_from((double) count/niter, dim);
 
-    /* Error estimation */
-    double  exact_prob = M_PI/4,
+    /* Error estimation: pi = (2^dim p/c)^(1/h) with h = dim/2 (integer) and the
+     * binomial error of p, so sigma_pi = pi/h sqrt((1-p)/(p niter)) (delta method)
+     */
+    double  exact_prob = volume(dim) / pow(2,dim),
             empirical_prob = (double) count/niter,
-            exact_err = pow(2,dim) * sqrt(exact_prob * (1-exact_prob) / niter),                 // only valid for dim=2 !!!!!
-            empirical_err = pow(2, dim) * sqrt(empirical_prob * (1-empirical_prob) / (niter-1));        // only valid for dim=2 !!!!!
+            exact_err = M_PI / ((int)dim/2) * sqrt((1-exact_prob) / (exact_prob * niter)),
+            empirical_err = pi / ((int)dim/2) * sqrt((1-empirical_prob) / (empirical_prob * (niter-1)));
 
     /* END */
 
-    printf("Number of points: %.2e\t Inside: %d (%.2f%%)\n", (float) niter, count, (float) count/niter*100);
+    printf("Number of points: %.2e\t Inside: %lu (%.2f%%)\n", (double) niter, count, (double) count/niter*100);
+    if (!count) printf("WARNING: no points inside the sphere (expected %.3g), use -m ratio or -m cond\n", exact_prob*niter);
     printf("Estimation of pi: %.5f +- %.5f (%.5f)\n", pi, exact_err, empirical_err);
     printf("Deviation: %.5g sigmas\n", (pi-M_PI)/exact_err);
+    printf("Time: %.3f s\t%.4g samples/s\terror^2*time: %.3e\n", t, niter/t, exact_err*exact_err*t);
     //printf("Volume of %d-sphere: %1.5f \n", dim, volume_factor(dim)*pi);
 
     return 0;
@@ -85,6 +455,6 @@ double volume_factor (int n) {
         case 1: return 2;
         case 2: return 1;       // V_2 = pi = 1
         default:
-            return (float) 2/n * volume_factor(n-2);
+            return (double) 2/n * volume_factor(n-2);
     }
 }